@@ -0,0 +1,17 @@
+#include <iostream>
+#include "./harness/Workload.h"
+
+// Converts text workloads to the binary trace format main reads with mmap.
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		std::cerr << "usage <text workload> <binary workload>\n";
+		return 1;
+	}
+	WorkloadWriter writer;
+	for_each_text_op(argv[1], [&] (const Operation &op) {
+		writer.add(op);
+	});
+	writer.write(argv[2]);
+	std::cerr << argv[2] << " : " << writer.size() << " ops\n";
+	return 0;
+}
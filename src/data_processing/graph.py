@@ -95,16 +95,106 @@ def plot_err_2(df, exps, algors):
 
 
     plt.show()
-def main(fname):
+def add_latency_cols(df):
+    # latency_ns holds {op: {p50, p90, ...}}, flattened into columns like
+    # 'READ.p99'
+    if 'latency_ns' not in df.columns:
+        return df, []
+    lat = pd.json_normalize(df['latency_ns'].apply(lambda x: x if isinstance(x, dict) else {}))
+    lat.index = df.index
+    ops = sorted({c.split('.')[0] for c in lat.columns})
+    return df.join(lat), ops
+
+
+def plot_latency(df, exp, algors, ops, q='p99'):
+    df = df.loc[exp]
+    ops = [op for op in ops if f'{op}.{q}' in df.columns and df[f'{op}.{q}'].notna().any()]
+    if not ops:
+        return
+
+    fig, axes = plt.subplots(nrows=len(ops), squeeze=False)
+    for ax, op in zip(axes[:, 0], ops):
+        col = f'{op}.{q}'
+        for a in algors:
+            if a not in df.index:
+                continue
+            pts = df.loc[[a]].groupby('num_threads')[col].median() / 1000
+            ax.plot(pts.index, pts.values, '-o', label=a)
+
+        ax.legend()
+        ax.set_title(f'{exp} {op} {q}')
+        ax.set_yscale('log')
+        ax.set_xlabel('# Threads')
+        ax.set_ylabel('latency (us)')
+    fig.tight_layout()
+    fig.savefig(f'{exp} {q}.png')
+
+
+    plt.show()
+
+
+def plot_phases(df, exp, algors):
+    # throughput over time of the first run at the most threads, one line
+    # per tree across all its phases, unmeasured phases shaded
+    df = df.loc[exp]
+    if 'phases' not in df.columns or 'sample_ms' not in df.columns:
+        return
+
+    fig, ax = plt.subplots(1)
+    nt = df['num_threads'].max()
+    for a in algors:
+        if a not in df.index:
+            continue
+        runs = df.loc[[a]]
+        run = runs[(runs['num_threads'] == nt) & (runs['rep'] == 0)].iloc[0]
+        if pd.isna(run['sample_ms']):
+            continue
+        secs = run['sample_ms'] / 1000
+        t = 0
+        for p in run['phases']:
+            xs = [t + (i + 1) * secs for i in range(len(p['samples']))]
+            ax.plot(xs, [n / secs / SCALE for n in p['samples']], '-', label=a if t == 0 else None,
+                    color=f'C{list(algors).index(a)}')
+            if not p['measured']:
+                ax.axvspan(t, t + len(p['samples']) * secs, color='grey', alpha=0.1)
+            t += len(p['samples']) * secs
+
+    ax.legend()
+    ax.set_title(f'{exp}, {nt} threads')
+    ax.set_xlabel('time (s)')
+    ax.set_ylabel('M ops/sec')
+    fig.savefig(f'{exp} phases.png', bbox_inches='tight')
+
+
+    plt.show()
+
+
+def main(fname, q=None):
     df = pd.read_json(fname, lines=True)
+    if 'sustainable_rate' in df.columns:
+        # open-loop sweeps end with a line per tree of the rate it sustained
+        print(df[df['sustainable_rate'].notna()][['workload', 'algor', 'num_threads', 'arrival', 'slo_us', 'sustainable_rate']])
+        df = df[df['sustainable_rate'].isna()]
     df['workload'] = df['workload'].replace(WORKLOAD_REP)
     df['algor'] = df['algor'].replace(ALGOR_REP)
 
     algors = df.algor.unique()
     workloads = df.workload.unique()
 
+    df, ops = add_latency_cols(df)
     df = df.set_index(['workload', 'algor'])
 
+    if q == 'phases':
+        for wl in workloads:
+            plot_phases(df, wl, algors)
+        return
+
+    if q:
+        # median over repetitions of one latency percentile per thread count
+        for wl in workloads:
+            plot_latency(df, wl, algors, ops, q)
+        return
+
     #for wl in workloads:
     #    plot_err(df, wl, algors)
 
@@ -112,4 +202,5 @@ def main(fname):
         plot_err_2(df, p, algors)
 
 if __name__ == '__main__':
-    main(sys.argv[1])
+    # graph.py <results.json> [p50|p90|p99|p999|max|phases]
+    main(sys.argv[1], sys.argv[2] if len(sys.argv) > 2 else None)
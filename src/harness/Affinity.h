@@ -0,0 +1,132 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <tuple>
+#include <stdexcept>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std::string_literals;
+
+// Where the benchmark threads run. Thread i of a run is pinned to the i-th
+// cpu of the policy's order, wrapping around when there are more threads
+// than cpus.
+//   none     leave placement to the OS
+//   compact  fill a socket core by core, SMT siblings next to each other
+//   scatter  round robin over sockets, one thread per core before siblings
+//   smt-last every core of every socket before any second SMT thread
+class Affinity {
+	public:
+		enum class Policy { None, Compact, Scatter, SmtLast };
+
+	private:
+		struct Cpu {
+			int id;
+			int socket;
+			int core;
+			// position among the SMT siblings of its core
+			int smt;
+		};
+
+		Policy policy;
+		std::vector<int> order;
+		// the cpus the process was allowed before any thread was pinned
+		cpu_set_t allowed;
+
+		static int read_int(const std::string &path, int fallback) {
+			std::ifstream ifs(path);
+			int v;
+			return (ifs >> v) ? v : fallback;
+		}
+
+		// the cpus in set with their place in the topology
+		static std::vector<Cpu> topology(const cpu_set_t &set) {
+			std::vector<Cpu> cpus;
+			for (int id = 0; id < CPU_SETSIZE; ++id) {
+				if (!CPU_ISSET(id, &set))
+					continue;
+				const std::string dir = "/sys/devices/system/cpu/cpu"s + std::to_string(id) + "/topology/";
+				cpus.push_back({id, read_int(dir + "physical_package_id", 0), read_int(dir + "core_id", id), 0});
+			}
+			std::sort(cpus.begin(), cpus.end(), [] (const Cpu &a, const Cpu &b) {
+				return std::tie(a.socket, a.core, a.id) < std::tie(b.socket, b.core, b.id);
+			});
+			for (size_t i = 1; i < cpus.size(); ++i) {
+				if (cpus[i].socket == cpus[i - 1].socket && cpus[i].core == cpus[i - 1].core)
+					cpus[i].smt = cpus[i - 1].smt + 1;
+			}
+			return cpus;
+		}
+
+	public:
+		static Policy parse(const std::string &s) {
+			if (s == "none") return Policy::None;
+			if (s == "compact") return Policy::Compact;
+			if (s == "scatter") return Policy::Scatter;
+			if (s == "smt-last") return Policy::SmtLast;
+			throw std::runtime_error("unknown pinning policy "s + s);
+		}
+
+		explicit Affinity(Policy policy = Policy::None) : policy(policy) {
+			CPU_ZERO(&allowed);
+			if (policy == Policy::None)
+				return;
+			// read before any thread is pinned
+			if (sched_getaffinity(0, sizeof(allowed), &allowed))
+				throw std::runtime_error("sched_getaffinity failed");
+			std::vector<Cpu> cpus = topology(allowed);
+			if (policy == Policy::Scatter) {
+				// the n-th core of every socket before the n+1-th
+				std::vector<int> rank(cpus.size());
+				for (size_t i = 0, n = 0; i < cpus.size(); ++i) {
+					if (i && cpus[i].socket != cpus[i - 1].socket)
+						n = 0;
+					else if (i && !cpus[i].smt)
+						n++;
+					rank[i] = n;
+				}
+				std::vector<size_t> idx(cpus.size());
+				for (size_t i = 0; i < idx.size(); ++i)
+					idx[i] = i;
+				std::stable_sort(idx.begin(), idx.end(), [&] (size_t a, size_t b) {
+					return std::tie(cpus[a].smt, rank[a], cpus[a].socket) < std::tie(cpus[b].smt, rank[b], cpus[b].socket);
+				});
+				for (size_t i : idx)
+					order.push_back(cpus[i].id);
+				return;
+			}
+			if (policy == Policy::SmtLast) {
+				std::stable_sort(cpus.begin(), cpus.end(), [] (const Cpu &a, const Cpu &b) {
+					return a.smt < b.smt;
+				});
+			}
+			for (const Cpu &c : cpus)
+				order.push_back(c.id);
+		}
+
+		bool enabled() const {
+			return policy != Policy::None && !order.empty();
+		}
+
+		// pin the calling thread as thread i of the run
+		void pin(int i) const {
+			if (!enabled())
+				return;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(order[i % order.size()], &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		}
+
+		// Give the calling thread back every cpu the process had. omp's
+		// master thread is thread 0 of every parallel region, it has to be
+		// unpinned after each, threads it starts in between, the Sampler
+		// or a tree's flusher, would inherit its single cpu otherwise.
+		void unpin() const {
+			if (!enabled())
+				return;
+			pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+		}
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std::string_literals;
+
+// How the ops of a phase are handed out to the threads.
+//   shared       one shared counter bumped per op, the order ops start in
+//                follows the workload exactly, so a tail workload inserts
+//                at a single contended tail. The default.
+//   chunked      the shared counter bumped once per chunk of ops, every
+//                thread runs chunk consecutive ops of its own
+//   partitioned  thread t of T runs the t-th contiguous T-th of the ops,
+//                nothing shared
+//   strided      thread t of T runs ops t, t + T, t + 2T, ..., nothing
+//                shared. Nothing keeps threads in step either, a slow or
+//                descheduled thread falls behind without bound, so the
+//                order is not kept.
+// Only shared keeps the workload's order, the others are for workloads
+// where it does not matter.
+enum class Dispatch { Shared, Chunked, Partitioned, Strided };
+
+inline Dispatch parse_dispatch(const std::string &s) {
+	if (s == "shared") return Dispatch::Shared;
+	if (s == "chunked") return Dispatch::Chunked;
+	if (s == "partitioned") return Dispatch::Partitioned;
+	if (s == "strided") return Dispatch::Strided;
+	throw std::runtime_error("unknown dispatch mode "s + s);
+}
+
+inline const char *dispatch_name(Dispatch mode) {
+	static constexpr const char *NAMES[] = {"shared", "chunked", "partitioned", "strided"};
+	return NAMES[(int)mode];
+}
+
+// The op indexes [0, n) of one phase, split among threads as mode says.
+class Dispatcher {
+	const size_t n;
+	const size_t chunk;
+	const Dispatch mode;
+	alignas(64) std::atomic<size_t> claimed {0};
+
+	public:
+		// the indexes of one thread
+		class Cursor {
+			Dispatcher &d;
+			size_t pos, end, step;
+
+			public:
+				Cursor(Dispatcher &d, int thread, int threads) : d(d), pos(0), end(0), step(1) {
+					switch (d.mode) {
+						case Dispatch::Partitioned:
+							pos = d.n * thread / threads;
+							end = d.n * (thread + 1) / threads;
+							break;
+						case Dispatch::Strided:
+							pos = thread;
+							end = d.n;
+							step = threads;
+							break;
+						default:
+							// claimed on the first next()
+							break;
+					}
+				}
+
+				// false once the thread's share is done
+				bool next(size_t &i) {
+					if (pos >= end) {
+						if (d.mode == Dispatch::Partitioned || d.mode == Dispatch::Strided)
+							return false;
+						pos = d.claimed.fetch_add(d.chunk, std::memory_order_relaxed);
+						if (pos >= d.n)
+							return false;
+						end = std::min(pos + d.chunk, d.n);
+					}
+					i = pos;
+					pos += step;
+					return true;
+				}
+		};
+
+		Dispatcher(size_t n, Dispatch mode, size_t chunk) :
+			n(n), chunk(mode == Dispatch::Shared ? 1 : std::max<size_t>(chunk, 1)), mode(mode) {
+		}
+
+		// ops a generator stream claims at once under this mode, 1 where
+		// the order of the ops is kept
+		static size_t stream_chunk(Dispatch mode, size_t chunk) {
+			return mode == Dispatch::Shared ? 1 : std::max<size_t>(chunk, 1);
+		}
+
+		Cursor cursor(int thread, int threads) {
+			return Cursor(*this, thread, threads);
+		}
+};
@@ -0,0 +1,393 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <cstdint>
+#include <algorithm>
+#include "Workload.h"
+
+// splitmix64, every stream has its own
+class Random {
+	uint64_t state;
+
+	public:
+		explicit Random(uint64_t seed) : state(seed) {
+		}
+
+		uint64_t next() {
+			uint64_t z = (state += 0x9e3779b97f4a7c15UL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9UL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebUL;
+			return z ^ (z >> 31);
+		}
+
+		// uniform in [0, n)
+		uint64_t below(uint64_t n) {
+			return ((unsigned __int128)next() * n) >> 64;
+		}
+
+		// uniform in [0, 1)
+		double unit() {
+			return (next() >> 11) * 0x1.0p-53;
+		}
+};
+
+// Zipfian ranks in [0, n), 0 the most popular, drawn as in YCSB (Gray et
+// al., "Quickly generating billion-record synthetic databases"). n may grow
+// between calls. zeta(n) is summed exactly over the first EXACT ranks and
+// approximated by its integral beyond, so a growing n costs O(1).
+class Zipfian {
+	static constexpr uint64_t EXACT = 1 << 16;
+
+	const double theta;
+	const double alpha;
+	const double zeta2;
+	uint64_t counted = 0;
+	double zeta_counted = 0;
+	uint64_t items = 0;
+	double zetan = 0;
+	double eta = 0;
+
+	double zeta(uint64_t n) {
+		const uint64_t exact = std::min(n, EXACT);
+		if (counted > exact) {
+			counted = 0;
+			zeta_counted = 0;
+		}
+		while (counted < exact)
+			zeta_counted += std::pow((double)++counted, -theta);
+		if (n <= EXACT)
+			return zeta_counted;
+		return zeta_counted + (std::pow(n + 0.5, 1 - theta) - std::pow(EXACT + 0.5, 1 - theta)) / (1 - theta);
+	}
+
+	public:
+		explicit Zipfian(double theta) :
+			theta(theta), alpha(1 / (1 - theta)), zeta2(1 + std::pow(0.5, theta)) {
+		}
+
+		uint64_t next(Random &rng, uint64_t n) {
+			if (n <= 1)
+				return 0;
+			if (n != items) {
+				items = n;
+				zetan = zeta(n);
+				eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+			}
+			const double u = rng.unit();
+			const double uz = u * zetan;
+			if (uz < 1)
+				return 0;
+			if (uz < zeta2)
+				return 1;
+			return std::min<uint64_t>(n - 1, n * std::pow(eta * u - eta + 1, alpha));
+		}
+};
+
+// A YCSB style mix, parsed from "gen:<mix>[,<name>=<value>]...". The mix is
+// one of a-f or orders and sets every field, the names override them:
+//   ops, records          ops in the run, keys loaded before it
+//   read, update, insert, scan, rmw   op ratios, normalized to sum to 1
+//   dist                  uniform, zipfian or latest, keys the other ops hit
+//   order                 seq, jitter or hash, the order keys are inserted in
+//   theta, scan_len, jitter, seed
+struct GeneratorSpec {
+	enum class Distribution { Uniform, Zipfian, Latest };
+	// Keys are drawn as insert indexes and mapped to keys by the order.
+	// seq inserts 0, 1, 2, ..., jitter the same out of order within
+	// windows of jitter keys, hash spreads them over [0, 2^62).
+	enum class KeyOrder { Sequential, Jittered, Hashed };
+
+	std::string name;
+	long ops = 10000000;
+	long records = 1000000;
+	double read = 0, update = 0, insert = 0, scan = 0, rmw = 0;
+	Distribution dist = Distribution::Zipfian;
+	KeyOrder order = KeyOrder::Hashed;
+	double theta = 0.99;
+	int scan_len = 100;
+	long jitter = 1024;
+	uint64_t seed = 1;
+
+	void set_mix(const std::string &mix) {
+		if (mix == "a") {
+			read = 0.5; update = 0.5;
+		} else if (mix == "b") {
+			read = 0.95; update = 0.05;
+		} else if (mix == "c") {
+			read = 1;
+		} else if (mix == "d") {
+			read = 0.95; insert = 0.05;
+			dist = Distribution::Latest;
+		} else if (mix == "e") {
+			scan = 0.95; insert = 0.05;
+		} else if (mix == "f") {
+			read = 0.5; rmw = 0.5;
+		} else if (mix == "orders") {
+			// orders come in by time and are read right after
+			read = 0.5; insert = 0.5;
+			dist = Distribution::Latest;
+			order = KeyOrder::Jittered;
+		} else {
+			throw std::runtime_error("unknown mix "s + mix);
+		}
+	}
+
+	void set(const std::string &k, const std::string &v) {
+		if (k == "ops") ops = std::stol(v);
+		else if (k == "records") records = std::stol(v);
+		else if (k == "read") read = std::stod(v);
+		else if (k == "update") update = std::stod(v);
+		else if (k == "insert") insert = std::stod(v);
+		else if (k == "scan") scan = std::stod(v);
+		else if (k == "rmw") rmw = std::stod(v);
+		else if (k == "theta") theta = std::stod(v);
+		else if (k == "scan_len") scan_len = std::stoi(v);
+		else if (k == "jitter") jitter = std::stol(v);
+		else if (k == "seed") seed = std::stoul(v);
+		else if (k == "dist") {
+			if (v == "uniform") dist = Distribution::Uniform;
+			else if (v == "zipfian") dist = Distribution::Zipfian;
+			else if (v == "latest") dist = Distribution::Latest;
+			else throw std::runtime_error("unknown distribution "s + v);
+		} else if (k == "order") {
+			if (v == "seq") order = KeyOrder::Sequential;
+			else if (v == "jitter") order = KeyOrder::Jittered;
+			else if (v == "hash") order = KeyOrder::Hashed;
+			else throw std::runtime_error("unknown key order "s + v);
+		} else
+			throw std::runtime_error("unknown generator option "s + k);
+	}
+
+	static bool matches(const std::string &s) {
+		return s.rfind("gen:", 0) == 0;
+	}
+
+	static GeneratorSpec parse(const std::string &s) {
+		if (!matches(s))
+			throw std::runtime_error("not a generator spec "s + s);
+		GeneratorSpec spec;
+		spec.name = s;
+		std::istringstream in(s.substr(4));
+		std::string item;
+		bool first = true;
+		while (std::getline(in, item, ',')) {
+			const size_t eq = item.find('=');
+			if (first && eq == std::string::npos)
+				spec.set_mix(item);
+			else if (eq == std::string::npos)
+				throw std::runtime_error("expected <name>=<value> in "s + s);
+			else
+				spec.set(item.substr(0, eq), item.substr(eq + 1));
+			first = false;
+		}
+		const double sum = spec.read + spec.update + spec.insert + spec.scan + spec.rmw;
+		if (!(sum > 0))
+			throw std::runtime_error("no ops in "s + s);
+		for (double *r : {&spec.read, &spec.update, &spec.insert, &spec.scan, &spec.rmw})
+			*r /= sum;
+		if (!(spec.theta > 0 && spec.theta < 1))
+			throw std::runtime_error("theta must be in (0, 1)");
+		spec.scan_len = std::max(spec.scan_len, 1);
+		// a power of two, so the shuffle within a window is a bijection
+		long j = 1;
+		while (j < spec.jitter)
+			j *= 2;
+		spec.jitter = j;
+		spec.records = std::max(spec.records, 0L);
+		return spec;
+	}
+};
+
+// Produces the ops of a GeneratorSpec on the fly, nothing is materialized.
+// Every thread draws from a Stream of its own. Streams share the op budget
+// and the count of keys inserted so far, so reads follow the inserts of all
+// threads. A read may pick a key whose insert was claimed but has not
+// finished yet and miss, as a client racing another client would.
+class WorkloadGenerator {
+	const GeneratorSpec spec;
+	// ops handed out by all streams
+	mutable std::atomic<long> issued;
+	// insert indexes handed out, records included
+	mutable std::atomic<long> inserted;
+	mutable std::atomic<uint64_t> streams;
+
+	static uint64_t mix(uint64_t h) {
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdUL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	public:
+		class Stream {
+			const WorkloadGenerator &gen;
+			Random rng;
+			Zipfian zipf;
+			// ops claimed at once, and what is left of the last claim
+			const uint64_t chunk;
+			uint64_t left = 0;
+
+			uint64_t pick(uint64_t n) {
+				switch (gen.spec.dist) {
+					case GeneratorSpec::Distribution::Uniform:
+						return rng.below(n);
+					case GeneratorSpec::Distribution::Latest:
+						return n - 1 - zipf.next(rng, n);
+					default:
+						// hot ranks spread over the key space as in
+						// YCSB's scrambled zipfian
+						return mix(zipf.next(rng, n)) % n;
+				}
+			}
+
+			public:
+				Stream(const WorkloadGenerator &gen, uint64_t id, uint64_t chunk) :
+					gen(gen), rng(mix(gen.spec.seed) ^ mix(id + 1)), zipf(gen.spec.theta), chunk(chunk) {
+				}
+
+				// false once the run's ops are handed out
+				bool next(Operation &op) {
+					const GeneratorSpec &s = gen.spec;
+					if (!left) {
+						const uint64_t claim = gen.issued.fetch_add(chunk, std::memory_order_relaxed);
+						if (claim >= s.ops)
+							return false;
+						left = std::min(chunk, s.ops - claim);
+					}
+					left--;
+					double u = rng.unit();
+					if (u < s.insert) {
+						op = Operation(Operation::INSERT, gen.key_of(gen.inserted.fetch_add(1, std::memory_order_relaxed)));
+						return true;
+					}
+					const long n = std::max(gen.inserted.load(std::memory_order_relaxed), 1L);
+					const long k = gen.key_of(pick(n));
+					u -= s.insert;
+					if (u < s.read)
+						op = Operation(Operation::READ, k);
+					else if ((u -= s.read) < s.update)
+						op = Operation(Operation::UPDATE, k);
+					else if ((u -= s.update) < s.scan)
+						op = Operation(Operation::SCAN, k, 1 + rng.below(s.scan_len));
+					else
+						op = Operation(Operation::READ_MODIFY_WRITE, k);
+					return true;
+				}
+		};
+
+		explicit WorkloadGenerator(const GeneratorSpec &spec) :
+			spec(spec), issued(0), inserted(spec.records), streams(0) {
+		}
+
+		// ops in a run
+		size_t size() const {
+			return spec.ops;
+		}
+
+		// keys to load before a run, key_of(0) to key_of(records() - 1)
+		long records() const {
+			return spec.records;
+		}
+
+		// insert indexes handed out so far, after a run the keys it wrote
+		// are key_of(0) to key_of(inserted_count() - 1)
+		long inserted_count() const {
+			return inserted.load();
+		}
+
+		// the key inserted n-th
+		long key_of(uint64_t n) const {
+			switch (spec.order) {
+				case GeneratorSpec::KeyOrder::Sequential:
+					return n;
+				case GeneratorSpec::KeyOrder::Jittered: {
+					// an odd multiplier permutes a power of two window
+					const uint64_t w = spec.jitter;
+					return (n & ~(w - 1)) | ((n * 0x9e3779b97f4a7c15UL) & (w - 1));
+				}
+				default: {
+					// xorshifts and odd multipliers are bijections on
+					// [0, 2^62), keys stay distinct and non-negative
+					const uint64_t m = (1UL << 62) - 1;
+					uint64_t h = n & m;
+					h ^= h >> 31;
+					h = (h * 0xbf58476d1ce4e5b9UL) & m;
+					h ^= h >> 29;
+					h = (h * 0x94d049bb133111ebUL) & m;
+					h ^= h >> 32;
+					return h;
+				}
+			}
+		}
+
+		// start a run over, with only the records loaded
+		void rewind() const {
+			issued.store(0);
+			inserted.store(spec.records);
+			streams.store(0);
+		}
+
+		// A stream for one thread, claiming chunk ops at a time. Inserts
+		// take the next key one by one all the same, so that the keys
+		// written stay key_of(0) to key_of(inserted_count() - 1).
+		Stream stream(uint64_t chunk = 1) const {
+			return Stream(*this, streams.fetch_add(1), std::max<uint64_t>(chunk, 1));
+		}
+};
+
+// The records of a generator as a workload of their inserts, run before the
+// generator's own ops.
+class GeneratorLoad {
+	const WorkloadGenerator &gen;
+	mutable std::atomic<long> next;
+
+	public:
+		class Stream {
+			const GeneratorLoad &load;
+			const long chunk;
+			// the records of the last claim not inserted yet
+			long pos = 0, end = 0;
+
+			public:
+				Stream(const GeneratorLoad &load, long chunk) : load(load), chunk(chunk) {
+				}
+
+				bool next(Operation &op) {
+					if (pos == end) {
+						pos = load.next.fetch_add(chunk, std::memory_order_relaxed);
+						if (pos >= load.gen.records())
+							return false;
+						end = std::min(pos + chunk, load.gen.records());
+					}
+					op = Operation(Operation::INSERT, load.gen.key_of(pos++));
+					return true;
+				}
+		};
+
+		explicit GeneratorLoad(const WorkloadGenerator &gen) : gen(gen), next(0) {
+		}
+
+		size_t size() const {
+			return gen.records();
+		}
+
+		long inserted_count() const {
+			return gen.records();
+		}
+
+		long key_of(uint64_t n) const {
+			return gen.key_of(n);
+		}
+
+		void rewind() const {
+			next.store(0);
+		}
+
+		// records are inserted in order, chunk at a time per thread
+		Stream stream(long chunk = 1) const {
+			return Stream(*this, std::max(chunk, 1L));
+		}
+};
@@ -0,0 +1,176 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <ostream>
+#include "Workload.h"
+
+// Log-linear histogram of nanosecond latencies in the style of
+// HdrHistogram. Every power of two is split into SUB buckets, so a value is
+// kept to within 1/SUB of itself, from 1ns up to 2^64ns, in a fixed 15KB
+// array.
+class Histogram {
+	static constexpr unsigned SUB_BITS = 5;
+	static constexpr uint64_t SUB = 1 << SUB_BITS;
+	static constexpr unsigned BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+	std::array<uint64_t, BUCKETS> counts {};
+	uint64_t total = 0;
+	uint64_t max_value = 0;
+
+	static unsigned index(uint64_t v) {
+		if (v < SUB)
+			return v;
+		const unsigned shift = 63 - __builtin_clzl(v) - SUB_BITS;
+		return ((shift + 1) << SUB_BITS) | ((v >> shift) & (SUB - 1));
+	}
+
+	// largest value that lands in bucket i
+	static uint64_t highest(unsigned i) {
+		if (i < SUB)
+			return i;
+		const unsigned shift = (i >> SUB_BITS) - 1;
+		return ((((i & (SUB - 1)) | SUB) + 1) << shift) - 1;
+	}
+
+	public:
+		void record(uint64_t ns) {
+			counts[index(ns)]++;
+			total++;
+			max_value = std::max(max_value, ns);
+		}
+
+		void merge(const Histogram &other) {
+			for (unsigned i = 0; i < BUCKETS; ++i)
+				counts[i] += other.counts[i];
+			total += other.total;
+			max_value = std::max(max_value, other.max_value);
+		}
+
+		uint64_t count() const {
+			return total;
+		}
+
+		uint64_t max() const {
+			return max_value;
+		}
+
+		// smallest bucket bound at or below which a fraction q of the values
+		// lie, q in [0, 1]
+		uint64_t percentile(double q) const {
+			if (!total)
+				return 0;
+			const uint64_t rank = std::max<uint64_t>(1, q * total + 0.5);
+			uint64_t seen = 0;
+			for (unsigned i = 0; i < BUCKETS; ++i) {
+				seen += counts[i];
+				if (seen >= rank)
+					return std::min(highest(i), max_value);
+			}
+			return max_value;
+		}
+
+		// {"count":..,"p50":..,"p90":..,"p99":..,"p999":..,"max":..}
+		void print_json(std::ostream &os) const {
+			os << "{\"count\":" << total
+				<< ",\"p50\":" << percentile(0.5)
+				<< ",\"p90\":" << percentile(0.9)
+				<< ",\"p99\":" << percentile(0.99)
+				<< ",\"p999\":" << percentile(0.999)
+				<< ",\"max\":" << max_value << '}';
+		}
+};
+
+// Per thread latencies, one histogram per op type. Timing every op costs
+// two clock reads, with a sample interval of n only about one op in n is
+// timed. The gap to the next timed op is drawn at random with mean n, a
+// fixed stride would alias with workloads that alternate op types.
+class LatencyRecorder {
+	public:
+		static constexpr int OP_TYPES = Operation::READ_MODIFY_WRITE + 1;
+
+	private:
+		std::array<Histogram, OP_TYPES> hists;
+		// 0 records nothing
+		uint64_t interval;
+		uint64_t countdown;
+		uint64_t rng;
+
+		uint64_t gap() {
+			if (interval <= 1)
+				return 1;
+			rng ^= rng << 13;
+			rng ^= rng >> 7;
+			rng ^= rng << 17;
+			return 1 + rng % (2 * interval - 1);
+		}
+
+	public:
+		explicit LatencyRecorder(uint64_t interval = 1, uint64_t seed = 1) :
+			interval(interval), rng(seed * 0x9e3779b97f4a7c15UL | 1) {
+			countdown = gap();
+		}
+
+		bool enabled() const {
+			return interval;
+		}
+
+		// runs f, timing it if this op is sampled
+		template<class F>
+		void time(long op_type, F f) {
+			if (!interval || --countdown) {
+				f();
+				return;
+			}
+			countdown = gap();
+			const auto start = std::chrono::steady_clock::now();
+			f();
+			const auto finish = std::chrono::steady_clock::now();
+			hists[op_type].record(std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count());
+		}
+
+		// runs f, timing it if this op is sampled, from due rather than from
+		// when f starts, for an op that was meant to start at due
+		template<class F>
+		void time_since(long op_type, std::chrono::steady_clock::time_point due, F f) {
+			if (!interval || --countdown) {
+				f();
+				return;
+			}
+			countdown = gap();
+			f();
+			const auto finish = std::chrono::steady_clock::now();
+			hists[op_type].record(std::chrono::duration_cast<std::chrono::nanoseconds>(finish - due).count());
+		}
+
+		// the latencies of all op types together
+		Histogram all() const {
+			Histogram h;
+			for (const Histogram &op : hists)
+				h.merge(op);
+			return h;
+		}
+
+		void merge(const LatencyRecorder &other) {
+			for (int i = 0; i < OP_TYPES; ++i)
+				hists[i].merge(other.hists[i]);
+		}
+
+		// {"READ":{...},"INSERT":{...}}, op types that were never timed are
+		// left out
+		void print_json(std::ostream &os) const {
+			os << '{';
+			bool first = true;
+			for (int i = 0; i < OP_TYPES; ++i) {
+				if (!hists[i].count())
+					continue;
+				if (!first)
+					os << ',';
+				first = false;
+				os << '"' << Operation::name(i) << "\":";
+				hists[i].print_json(os);
+			}
+			os << '}';
+		}
+};
@@ -0,0 +1,97 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <stdexcept>
+#include <immintrin.h>
+#include "Generator.h"
+
+using namespace std::string_literals;
+
+// When the ops of an open-loop run arrive, at a rate fixed beforehand no
+// matter how fast the tree serves them.
+//   uniform  evenly spaced
+//   poisson  independent arrivals, exponential gaps
+//   bursty   bursts of a fixed number of ops due at once, the bursts
+//            themselves arriving as poisson
+enum class Arrival { Uniform, Poisson, Bursty };
+
+inline Arrival parse_arrival(const std::string &s) {
+	if (s == "uniform") return Arrival::Uniform;
+	if (s == "poisson") return Arrival::Poisson;
+	if (s == "bursty") return Arrival::Bursty;
+	throw std::runtime_error("unknown arrival schedule "s + s);
+}
+
+inline const char *arrival_name(Arrival a) {
+	static constexpr const char *NAMES[] = {"uniform", "poisson", "bursty"};
+	return NAMES[(int)a];
+}
+
+// The schedule of one thread's ops in an open-loop run, its share of the
+// run's rate. A thread waits for each op's intended start, and an op that
+// is late because the ones before it took too long runs right away, with
+// its latency still counted from when it was due. Timing from the actual
+// start instead would leave out the queueing, which is coordinated
+// omission.
+class Pacer {
+	using clock = std::chrono::steady_clock;
+
+	// further off than this a waiting thread yields, closer it spins.
+	// Sleeping would oversleep by far more than an op takes, and the
+	// lateness would count as the tree's latency.
+	static constexpr int64_t YIELD_NS = 20000;
+
+	const clock::time_point begin;
+	// mean ns between two of this thread's ops
+	const double gap;
+	const Arrival arrival;
+	const long burst;
+	Random rng;
+	// intended start of the next op, ns after begin
+	double due = 0;
+	long burst_left;
+
+	double exponential(double mean) {
+		return -std::log1p(-rng.unit()) * mean;
+	}
+
+	void advance() {
+		switch (arrival) {
+			case Arrival::Uniform:
+				due += gap;
+				break;
+			case Arrival::Poisson:
+				due += exponential(gap);
+				break;
+			case Arrival::Bursty:
+				if (!--burst_left) {
+					due += exponential(gap * burst);
+					burst_left = burst;
+				}
+				break;
+		}
+	}
+
+	public:
+		// rate in ops per second over all threads
+		Pacer(clock::time_point begin, double rate, int thread, int threads, Arrival arrival, long burst) :
+			begin(begin), gap(1e9 * threads / rate), arrival(arrival), burst(std::max(burst, 1L)),
+			rng(thread + 1), burst_left(this->burst) {
+			// threads start out of step with each other
+			due = arrival == Arrival::Uniform ? gap * thread / threads : exponential(gap * (arrival == Arrival::Bursty ? this->burst : 1));
+		}
+
+		// waits for the next op to be due and returns when it was
+		clock::time_point wait() {
+			const clock::time_point at = begin + std::chrono::nanoseconds((int64_t)due);
+			advance();
+			while (at - clock::now() > std::chrono::nanoseconds(YIELD_NS))
+				std::this_thread::yield();
+			while (clock::now() < at)
+				_mm_pause();
+			return at;
+		}
+};
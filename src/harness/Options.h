@@ -0,0 +1,155 @@
+#pragma once
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <vector>
+#include "Affinity.h"
+#include "Dispatch.h"
+#include "OpenLoop.h"
+
+using namespace std::string_literals;
+
+// Command line of the benchmark driver, [--<name>=<value>]... <workload>
+struct Options {
+	std::string workload;
+	// time about one op in this many, 0 turns latency recording off. Off
+	// by default, timing ops costs clock reads that throughput numbers
+	// without latencies should not pay.
+	long latency_sample = 0;
+	// thread counts to sweep, empty runs once with omp's default
+	std::vector<int> threads;
+	// runs of every tree per thread count
+	int reps = 1;
+	Affinity affinity;
+	// check the tree against the keys written after every run
+	bool verify = true;
+	// record the ops on about one key in this many and check them for
+	// linearizability, 0 records nothing
+	long history = 0;
+	// read hardware counters over the timed region
+	bool perf = false;
+	// ms between throughput samples, 0 takes none
+	long sample_ms = 10;
+	// how threads claim ops, see Dispatch
+	Dispatch dispatch = Dispatch::Shared;
+	size_t chunk = 1024;
+	// open-loop target rates in ops per second to sweep, empty runs closed
+	// loop, and the rate of the run going on, 0 when closed loop
+	std::vector<double> rates;
+	double rate = 0;
+	Arrival arrival = Arrival::Poisson;
+	long burst = 32;
+	// p99 latency a rate has to keep to be sustainable
+	double slo_us = 1000;
+
+	static void usage() {
+		std::cerr << "usage [options] <workload file | gen:<mix>[,<name>=<value>]...>\n"
+			"  --latency-sample=N  time about one op in N, 0 for none (default 0, open\n"
+			"                      loop runs time every op unless told otherwise)\n"
+			"  --threads=LIST      thread counts to sweep, e.g. 1,2,4-8 (default omp's)\n"
+			"  --reps=N            runs of every tree per thread count (default 1)\n"
+			"  --pin=POLICY        none, compact, scatter or smt-last (default none)\n"
+			"  --verify=0|1        check the tree after every run (default 1)\n"
+			"  --history=N         check the ops on about one key in N for\n"
+			"                      linearizability, 0 for none (default 0)\n"
+			"  --perf=0|1          report hardware counters per op (default 0)\n"
+			"  --sample-ms=N       sample ops done every N ms, 0 for never (default 10)\n"
+			"  --dispatch=MODE     how threads claim ops, shared, chunked, partitioned\n"
+			"                      or strided (default shared), only shared keeps\n"
+			"                      the workload's order\n"
+			"  --chunk=N           ops claimed at once when chunked (default 1024)\n"
+			"  --rate=LIST         run open loop at these total ops/sec, e.g.\n"
+			"                      1e5,2e5,4e5, and report the highest one that\n"
+			"                      keeps p99 under --slo-us (default closed loop)\n"
+			"  --arrival=SCHEDULE  uniform, poisson or bursty (default poisson)\n"
+			"  --burst=N           ops per burst when bursty (default 32)\n"
+			"  --slo-us=N          p99 latency a rate must keep (default 1000)\n"
+			"A workload may run in phases, <phase>[+<phase>]..., a phase prefixed\n"
+			"with warm: is not measured.\n";
+	}
+
+	// "1,2,4-8" to 1 2 4 5 6 7 8
+	static std::vector<int> parse_list(const std::string &s) {
+		std::vector<int> out;
+		std::istringstream in(s);
+		std::string item;
+		while (std::getline(in, item, ',')) {
+			const size_t dash = item.find('-');
+			const int lo = std::stoi(item.substr(0, dash));
+			const int hi = dash == std::string::npos ? lo : std::stoi(item.substr(dash + 1));
+			if (lo < 1 || hi < lo)
+				throw std::runtime_error("bad thread count "s + item);
+			for (int t = lo; t <= hi; ++t)
+				out.push_back(t);
+		}
+		return out;
+	}
+
+	// "1e5,2e5" to 100000 200000, increasing
+	static std::vector<double> parse_rates(const std::string &s) {
+		std::vector<double> out;
+		std::istringstream in(s);
+		std::string item;
+		while (std::getline(in, item, ',')) {
+			const double r = std::stod(item);
+			if (r <= 0)
+				throw std::runtime_error("bad rate "s + item);
+			out.push_back(r);
+		}
+		std::sort(out.begin(), out.end());
+		return out;
+	}
+
+	void set(const std::string &k, const std::string &v) {
+		if (k == "latency-sample")
+			latency_sample = std::stol(v);
+		else if (k == "threads")
+			threads = parse_list(v);
+		else if (k == "reps")
+			reps = std::max(std::stoi(v), 1);
+		else if (k == "verify")
+			verify = std::stoi(v);
+		else if (k == "sample-ms")
+			sample_ms = std::max(std::stol(v), 0L);
+		else if (k == "dispatch")
+			dispatch = parse_dispatch(v);
+		else if (k == "chunk")
+			chunk = std::max(std::stol(v), 1L);
+		else if (k == "rate")
+			rates = parse_rates(v);
+		else if (k == "arrival")
+			arrival = parse_arrival(v);
+		else if (k == "burst")
+			burst = std::max(std::stol(v), 1L);
+		else if (k == "slo-us")
+			slo_us = std::stod(v);
+		else if (k == "perf")
+			perf = std::stoi(v);
+		else if (k == "history")
+			history = std::max(std::stol(v), 0L);
+		else if (k == "pin")
+			affinity = Affinity(Affinity::parse(v));
+		else
+			throw std::runtime_error("unknown option --"s + k);
+	}
+
+	// false if the command line is malformed
+	bool parse(int argc, char **argv) {
+		for (int i = 1; i < argc; ++i) {
+			const std::string arg = argv[i];
+			if (arg.rfind("--", 0) == 0) {
+				const size_t eq = arg.find('=');
+				if (eq == std::string::npos)
+					return false;
+				set(arg.substr(2, eq - 2), arg.substr(eq + 1));
+			} else if (workload.empty()) {
+				workload = arg;
+			} else {
+				return false;
+			}
+		}
+		return !workload.empty();
+	}
+};
@@ -0,0 +1,152 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <algorithm>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// config of a PERF_TYPE_HW_CACHE event
+constexpr uint64_t perf_cache_event(uint64_t id, uint64_t op, uint64_t result) {
+	return id | (op << 8) | (result << 16);
+}
+
+// Hardware counters of the calling thread, user space only. Every event is
+// opened on its own rather than as one group, a group with more events than
+// the PMU has counters would never be scheduled, this way the kernel
+// multiplexes them and each count is scaled by the time it ran. Events the
+// machine or the kernel's perf_event_paranoid setting do not allow are left
+// out, without any the counters are simply not available.
+class PerfCounters {
+	public:
+		struct Event {
+			const char *name;
+			uint32_t type;
+			uint64_t config;
+		};
+
+		static constexpr int NUM_EVENTS = 7;
+		static constexpr std::array<Event, NUM_EVENTS> EVENTS = {{
+			{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{"l1d_misses", PERF_TYPE_HW_CACHE, perf_cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+			{"llc_misses", PERF_TYPE_HW_CACHE, perf_cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+			{"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+			{"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+			{"stalled_cycles_backend", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+		}};
+
+		// counts summed over threads, -1 for events that could not be opened
+		struct Counts {
+			std::array<double, NUM_EVENTS> value;
+
+			Counts() {
+				value.fill(-1);
+			}
+
+			bool any() const {
+				for (double v : value) {
+					if (v >= 0)
+						return true;
+				}
+				return false;
+			}
+
+			void merge(const Counts &other) {
+				for (int i = 0; i < NUM_EVENTS; ++i) {
+					if (other.value[i] < 0)
+						continue;
+					value[i] = std::max(value[i], 0.0) + other.value[i];
+				}
+			}
+
+			// {"cycles":..,...} divided by ops
+			void print_json(std::ostream &os, double ops) const {
+				os << '{';
+				bool first = true;
+				for (int i = 0; i < NUM_EVENTS; ++i) {
+					if (value[i] < 0)
+						continue;
+					if (!first)
+						os << ',';
+					first = false;
+					os << '"' << EVENTS[i].name << "\":" << value[i] / ops;
+				}
+				os << '}';
+			}
+		};
+
+	private:
+		// -1 for events that could not be opened
+		std::array<int, NUM_EVENTS> fds;
+
+		static int open_event(const Event &e) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = e.type;
+			attr.config = e.config;
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+
+	public:
+		PerfCounters() {
+			for (int i = 0; i < NUM_EVENTS; ++i)
+				fds[i] = open_event(EVENTS[i]);
+		}
+
+		PerfCounters(const PerfCounters &) = delete;
+		PerfCounters &operator=(const PerfCounters &) = delete;
+
+		~PerfCounters() {
+			for (int fd : fds) {
+				if (fd >= 0)
+					close(fd);
+			}
+		}
+
+		bool available() const {
+			for (int fd : fds) {
+				if (fd >= 0)
+					return true;
+			}
+			return false;
+		}
+
+		void start() {
+			for (int fd : fds) {
+				if (fd >= 0) {
+					ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+					ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+				}
+			}
+		}
+
+		void stop() {
+			for (int fd : fds) {
+				if (fd >= 0)
+					ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+			}
+		}
+
+		// counts since start(), scaled up for the time an event was
+		// multiplexed out
+		Counts read() const {
+			Counts c;
+			for (int i = 0; i < NUM_EVENTS; ++i) {
+				// value, time enabled, time running
+				uint64_t buf[3];
+				if (fds[i] < 0 || ::read(fds[i], buf, sizeof(buf)) != sizeof(buf) || !buf[2])
+					continue;
+				c.value[i] = buf[0] * ((double)buf[1] / buf[2]);
+			}
+			return c;
+		}
+};
@@ -0,0 +1,188 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+#include <ostream>
+#include <condition_variable>
+#include "Workload.h"
+#include "Generator.h"
+#include "Verify.h"
+
+// A run as a sequence of phases, "<phase>[+<phase>]...", each phase a
+// workload file or a generator spec. A phase prefixed with "warm:" runs
+// without being measured, a generator's records are loaded in a phase of
+// their own before it, "load", that is not measured either. Only measured
+// phases count towards ops_per_sec, latencies and counters.
+class PhasedWorkload {
+	public:
+		struct Phase {
+			std::string name;
+			bool measured;
+			std::variant<const std::vector<Operation> *, const MappedWorkload *,
+				const WorkloadGenerator *, const GeneratorLoad *> ops;
+		};
+
+	private:
+		std::vector<std::unique_ptr<std::vector<Operation>>> texts;
+		std::vector<std::unique_ptr<MappedWorkload>> traces;
+		std::vector<std::unique_ptr<WorkloadGenerator>> gens;
+		std::vector<std::unique_ptr<GeneratorLoad>> loads;
+		std::vector<Phase> phase_list;
+
+		void add(const std::string &spec) {
+			const bool warm = spec.rfind("warm:", 0) == 0;
+			const std::string src = warm ? spec.substr(5) : spec;
+			// ops are generated on the fly for a gen: spec, see
+			// GeneratorSpec. Binary traces from convert_workload are
+			// mapped, text ones parsed.
+			if (GeneratorSpec::matches(src)) {
+				gens.emplace_back(new WorkloadGenerator(GeneratorSpec::parse(src)));
+				loads.emplace_back(new GeneratorLoad(*gens.back()));
+				if (loads.back()->size())
+					phase_list.push_back({"load", false, loads.back().get()});
+				phase_list.push_back({src, !warm, gens.back().get()});
+			} else if (is_binary_workload(src)) {
+				traces.emplace_back(new MappedWorkload(src));
+				phase_list.push_back({src, !warm, traces.back().get()});
+			} else {
+				texts.emplace_back(new std::vector<Operation>(read_workload(src)));
+				phase_list.push_back({src, !warm, texts.back().get()});
+			}
+		}
+
+	public:
+		explicit PhasedWorkload(const std::string &spec) {
+			size_t begin = 0;
+			while (true) {
+				const size_t end = spec.find('+', begin);
+				add(spec.substr(begin, end - begin));
+				if (end == std::string::npos)
+					break;
+				begin = end + 1;
+			}
+		}
+
+		const std::vector<Phase> &phases() const {
+			return phase_list;
+		}
+
+		// ops in the measured phases
+		size_t size() const {
+			size_t n = 0;
+			for (const Phase &p : phase_list) {
+				if (p.measured)
+					n += std::visit([] (auto *ops) { return ops->size(); }, p.ops);
+			}
+			return n;
+		}
+
+		// reset the generators for the next run
+		void rewind() const {
+			for (const auto &g : gens)
+				g->rewind();
+			for (const auto &l : loads)
+				l->rewind();
+		}
+};
+
+// keys written by any phase, sorted and deduped
+inline std::vector<long> written_keys(const PhasedWorkload &workload) {
+	std::vector<long> keys;
+	for (const auto &p : workload.phases()) {
+		const std::vector<long> part = std::visit([] (auto *ops) {
+			return written_keys(*ops);
+		}, p.ops);
+		keys.insert(keys.end(), part.begin(), part.end());
+	}
+	__gnu_parallel::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	return keys;
+}
+
+// Ops completed per interval, sampled by a thread of its own while a run
+// goes on. Workers bump a counter of their own after every op, the sampler
+// sums them every interval and files the difference under the phase that
+// is running.
+class Sampler {
+	struct alignas(64) Counter {
+		std::atomic<long> ops {0};
+	};
+
+	const std::chrono::milliseconds interval;
+	std::unique_ptr<Counter[]> counters;
+	const int num_counters;
+	std::atomic<int> phase {0};
+	// per phase
+	std::vector<std::vector<long>> series;
+	std::mutex mu;
+	std::condition_variable cv;
+	bool done = false;
+	std::thread thread;
+
+	long total() const {
+		long n = 0;
+		for (int i = 0; i < num_counters; ++i)
+			n += counters[i].ops.load(std::memory_order_relaxed);
+		return n;
+	}
+
+	void loop() {
+		long last = 0;
+		auto next = std::chrono::steady_clock::now() + interval;
+		std::unique_lock<std::mutex> lk(mu);
+		while (!cv.wait_until(lk, next, [this] { return done; })) {
+			const long now = total();
+			series[phase.load()].push_back(now - last);
+			last = now;
+			next += interval;
+		}
+	}
+
+	public:
+		// interval_ms 0 samples nothing
+		Sampler(long interval_ms, int threads, size_t phases) :
+			interval(interval_ms), counters(new Counter[threads]), num_counters(threads), series(phases) {
+			if (interval_ms > 0)
+				thread = std::thread([this] { loop(); });
+		}
+
+		~Sampler() {
+			stop();
+		}
+
+		bool enabled() const {
+			return interval.count() > 0;
+		}
+
+		// called between phases, by the thread running them
+		void enter(int p) {
+			phase.store(p);
+		}
+
+		// one more op done by worker t
+		void count(int t) {
+			Counter &c = counters[t];
+			c.ops.store(c.ops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+
+		void stop() {
+			if (!thread.joinable())
+				return;
+			{
+				std::lock_guard<std::mutex> lk(mu);
+				done = true;
+			}
+			cv.notify_one();
+			thread.join();
+		}
+
+		// ops per interval of phase p, after stop()
+		const std::vector<long> &samples(int p) const {
+			return series[p];
+		}
+};
@@ -0,0 +1,345 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <parallel/algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include <limits>
+#include <climits>
+#include <omp.h>
+#include "Workload.h"
+
+// Keys a run wrote, sorted and deduped. For a generator these are the keys
+// inserted by the run just finished.
+template<class W>
+std::vector<long> written_keys(const W &ops) {
+	std::vector<long> keys;
+	if constexpr (requires { ops.stream(); }) {
+		keys.resize(ops.inserted_count());
+		#pragma omp parallel for schedule(static)
+		for (long i = 0; i < (long)keys.size(); ++i)
+			keys[i] = ops.key_of(i);
+	} else {
+		std::vector<std::vector<long>> parts(omp_get_max_threads());
+		#pragma omp parallel
+		{
+			std::vector<long> &mine = parts[omp_get_thread_num()];
+			#pragma omp for schedule(static)
+			for (size_t i = 0; i < ops.size(); ++i) {
+				const Operation op = ops[i];
+				if (op.get_op_type() != Operation::READ && op.get_op_type() != Operation::SCAN)
+					mine.push_back(op.get_key());
+			}
+		}
+		for (const auto &p : parts)
+			keys.insert(keys.end(), p.begin(), p.end());
+	}
+	__gnu_parallel::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+	return keys;
+}
+
+// Checks in parallel that every key in truth is in the tree with its own
+// key as value, unless skip(key), and that scanning the tree yields
+// exactly truth, which catches lost and phantom keys alike.
+template<class Tree, class Skip>
+bool verify(Tree &tree, const std::vector<long> &truth, Skip skip) {
+	static constexpr size_t CHUNK = 4096;
+	const size_t chunks = (truth.size() + CHUNK - 1) / CHUNK;
+	long errors = 0;
+
+	#pragma omp parallel reduction(+:errors)
+	{
+		std::vector<long> keys(CHUNK + 1), vals(CHUNK + 1);
+		#pragma omp for schedule(dynamic, 16)
+		for (size_t c = 0; c < chunks; ++c) {
+			const size_t lo = c * CHUNK;
+			const size_t hi = std::min(lo + CHUNK, truth.size());
+			for (size_t i = lo; i < hi; ++i) {
+				const long k = truth[i];
+				long v;
+				if (!tree.lookup(k, v)) {
+					#pragma omp critical(verify_log)
+					std::cerr << "Key missing : " << k << '\n';
+					errors++;
+				} else if (v != k && !skip(k)) {
+					#pragma omp critical(verify_log)
+					std::cerr << "Unexpected value from lookup : {key = " << k
+						<< ", value = " << v << "}\n";
+					errors++;
+				}
+			}
+			// the chunk's keys plus the first key past it, if any
+			const size_t want = hi - lo + (hi < truth.size());
+			const size_t n = tree.scan(truth[lo], want, keys.data(), vals.data());
+			if (n != want || !std::equal(keys.begin(), keys.begin() + n, truth.begin() + lo)) {
+				#pragma omp critical(verify_log)
+				std::cerr << "Scan from " << truth[lo] << " does not match the inserted keys\n";
+				errors++;
+			}
+		}
+	}
+	// nothing below the smallest key
+	if (!truth.empty()) {
+		long k, v;
+		if (tree.scan(std::numeric_limits<long>::min(), 1, &k, &v) != 1 || k != truth[0]) {
+			std::cerr << "Scan from the smallest key does not start at " << truth[0] << '\n';
+			errors++;
+		}
+	}
+	return !errors;
+}
+
+// Concurrent history of the point ops on a sample of the keys, checked
+// after the run for per-key linearizability. Writes to sampled keys store a
+// value unique to the write, so every read names the write it saw.
+class History {
+	public:
+		struct Event {
+			long key;
+			// the value written or read, 0 if the read found nothing
+			long value;
+			// ns since the run started, the op took effect in between
+			int64_t start, end;
+			int32_t thread;
+			bool write;
+			bool found;
+		};
+
+		// what one thread recorded
+		class Log {
+			const History &history;
+			const int thread;
+			// a log of its own per thread and phase, tells its writes apart
+			const long id;
+			long seq = 0;
+			std::vector<Event> events;
+
+			friend class History;
+
+			template<class Tree>
+			void write(Tree &tree, long k) {
+				const long v = value_of(id, seq++);
+				const int64_t s = history.now();
+				tree.insert(k, v);
+				events.push_back({k, v, s, history.now(), thread, true, true});
+			}
+
+			template<class Tree>
+			void read(Tree &tree, long k) {
+				long v = 0;
+				const int64_t s = history.now();
+				const bool found = tree.lookup(k, v);
+				events.push_back({k, found ? v : 0, s, history.now(), thread, false, found});
+			}
+
+			public:
+				Log(const History &history, int thread) : history(history), thread(thread), id(history.logs++) {
+				}
+
+				bool tracks(const Operation &op) const {
+					return op.get_op_type() != Operation::SCAN && history.tracks(op.get_key());
+				}
+
+				template<class Tree>
+				void apply(Tree &tree, const Operation &op) {
+					const long k = op.get_key();
+					switch (op.get_op_type()) {
+						case Operation::INSERT:
+						case Operation::UPDATE:
+							write(tree, k);
+							break;
+						case Operation::READ:
+							read(tree, k);
+							break;
+						case Operation::READ_MODIFY_WRITE:
+							read(tree, k);
+							write(tree, k);
+							break;
+					}
+				}
+		};
+
+	private:
+		// about one key in every keys is sampled
+		const long every;
+		std::chrono::steady_clock::time_point begin;
+		// ids handed to Logs so far
+		mutable std::atomic<long> logs {0};
+		std::mutex mu;
+		std::vector<Event> events;
+
+		enum Kind { UNKNOWN_VALUE, FUTURE_READ, READ_YOUR_WRITES, ZONE, KINDS };
+		static constexpr const char *KIND_NAMES[KINDS] = {
+			"read of a value never written", "read before its write started",
+			"read missed the thread's own earlier write", "not linearizable"
+		};
+
+		// Checks the history of one key, events sorted by start. Writes and
+		// the reads that saw them form clusters, a cluster's zone runs from
+		// the earliest end to the latest start among its ops. By Gibbons and
+		// Korach the history is linearizable iff no two forward zones (end
+		// before start) overlap and no backward zone lies in a forward one.
+		static void check_key(const Event *ev, size_t n, long (&found)[KINDS]) {
+			struct Zone {
+				int64_t lo, hi;
+			};
+			// what a read that found nothing saw
+			static constexpr long ABSENT = LONG_MIN;
+			std::unordered_map<long, size_t> writer;
+			for (size_t i = 0; i < n; ++i) {
+				if (ev[i].write)
+					writer[ev[i].value] = i;
+			}
+			// the key starts out absent, as a write before everything
+			std::unordered_map<long, Zone> cluster;
+			cluster[ABSENT] = {INT64_MIN, INT64_MIN};
+			for (size_t i = 0; i < n; ++i) {
+				const Event &e = ev[i];
+				const long v = e.write || e.found ? e.value : ABSENT;
+				if (!e.write && e.found) {
+					const auto w = writer.find(v);
+					if (w == writer.end()) {
+						found[UNKNOWN_VALUE]++;
+						continue;
+					}
+					if (e.end < ev[w->second].start)
+						found[FUTURE_READ]++;
+				}
+				auto c = cluster.find(v);
+				if (c == cluster.end())
+					cluster[v] = {e.end, e.start};
+				else {
+					c->second.lo = std::min(c->second.lo, e.end);
+					c->second.hi = std::max(c->second.hi, e.start);
+				}
+			}
+
+			std::vector<Zone> forward, backward;
+			for (const auto &[v, z] : cluster) {
+				if (z.lo < z.hi)
+					forward.push_back(z);
+				else
+					backward.push_back({z.hi, z.lo});
+			}
+			std::sort(forward.begin(), forward.end(), [] (const Zone &a, const Zone &b) {
+				return a.lo < b.lo;
+			});
+			for (size_t i = 1; i < forward.size(); ++i) {
+				if (forward[i].lo < forward[i - 1].hi)
+					found[ZONE]++;
+			}
+			for (const Zone &b : backward) {
+				auto f = std::upper_bound(forward.begin(), forward.end(), b.lo, [] (int64_t t, const Zone &z) {
+					return t <= z.lo;
+				});
+				if (f != forward.begin() && b.hi < std::prev(f)->hi)
+					found[ZONE]++;
+			}
+
+			// reads after a thread's own write see it or a later one
+			std::unordered_map<int32_t, size_t> last_write;
+			for (size_t i = 0; i < n; ++i) {
+				const Event &e = ev[i];
+				if (e.write) {
+					last_write[e.thread] = i;
+					continue;
+				}
+				const auto own = last_write.find(e.thread);
+				if (own == last_write.end())
+					continue;
+				if (!e.found) {
+					found[READ_YOUR_WRITES]++;
+					continue;
+				}
+				const auto w = writer.find(e.value);
+				if (w != writer.end() && ev[w->second].end < ev[own->second].start)
+					found[READ_YOUR_WRITES]++;
+			}
+		}
+
+	public:
+		explicit History(long every) : every(std::max(every, 1L)), begin(std::chrono::steady_clock::now()) {
+		}
+
+		// writes to sampled keys store these, negative so that they never
+		// pass for the key itself
+		static long value_of(long log, long seq) {
+			return -(((log + 1) << 40) | (seq + 1));
+		}
+
+		bool tracks(long key) const {
+			uint64_t h = key;
+			h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdUL;
+			h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53UL;
+			return (h ^ (h >> 33)) % every == 0;
+		}
+
+		int64_t now() const {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+		}
+
+		void merge(Log &log) {
+			std::lock_guard<std::mutex> lk(mu);
+			events.insert(events.end(), log.events.begin(), log.events.end());
+			log.events.clear();
+		}
+
+		size_t size() const {
+			return events.size();
+		}
+
+		// Reads every sampled key once more after the run, so that a lost
+		// write shows up, then checks each key's history. Returns the
+		// number of anomalies found.
+		template<class Tree>
+		long check(Tree &tree) {
+			const auto by_key = [] (const Event &a, const Event &b) {
+				return a.key != b.key ? a.key < b.key : a.start < b.start;
+			};
+			__gnu_parallel::sort(events.begin(), events.end(), by_key);
+			Log last(*this, -2);
+			for (size_t i = 0; i < events.size(); ++i) {
+				if (!i || events[i].key != events[i - 1].key)
+					last.read(tree, events[i].key);
+			}
+			merge(last);
+			__gnu_parallel::sort(events.begin(), events.end(), by_key);
+
+			std::vector<size_t> heads;
+			for (size_t i = 0; i < events.size(); ++i) {
+				if (!i || events[i].key != events[i - 1].key)
+					heads.push_back(i);
+			}
+			heads.push_back(events.size());
+
+			long found[KINDS] = {};
+			#pragma omp parallel
+			{
+				long mine[KINDS] = {};
+				#pragma omp for schedule(dynamic, 64)
+				for (size_t i = 0; i < heads.size() - 1; ++i) {
+					long before[KINDS];
+					std::copy(mine, mine + KINDS, before);
+					check_key(&events[heads[i]], heads[i + 1] - heads[i], mine);
+					if (!std::equal(mine, mine + KINDS, before)) {
+						#pragma omp critical(verify_log)
+						std::cerr << "history of key " << events[heads[i]].key << " is not linearizable\n";
+					}
+				}
+				#pragma omp critical(verify_log)
+				for (int k = 0; k < KINDS; ++k)
+					found[k] += mine[k];
+			}
+			long total = 0;
+			for (int k = 0; k < KINDS; ++k) {
+				if (found[k])
+					std::cerr << found[k] << " x " << KIND_NAMES[k] << '\n';
+				total += found[k];
+			}
+			return total;
+		}
+};
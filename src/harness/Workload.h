@@ -0,0 +1,231 @@
+#pragma once
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std::string_literals;
+
+class Operation {
+	public:
+		static const long INSERT = 0;
+		static const long READ = 1;
+		static const long UPDATE = 2;
+		static const long SCAN = 3;
+		// lookup followed by an update of the same key
+		static const long READ_MODIFY_WRITE = 4;
+
+	private:
+		int32_t op_type;
+		// entries a SCAN asks for
+		int32_t len;
+		long key;
+
+
+	public:
+		Operation(const std::string &op, long key) : len(0), key(key) {
+			if (op == "INSERT"s)
+				op_type = INSERT;
+			else if(op == "READ"s)
+				op_type = READ;
+			else
+				throw std::runtime_error("Unknown op type "s + op);
+		}
+
+		Operation(long op_type = INSERT, long key = 0, int len = 0) : op_type(op_type), len(len), key(key) {
+		}
+
+		long get_op_type() const {
+			return op_type;
+		}
+
+		long get_key() const {
+			return key;
+		}
+
+		int get_len() const {
+			return len;
+		}
+
+		static const char *name(long op_type) {
+			switch (op_type) {
+				case INSERT: return "INSERT";
+				case READ: return "READ";
+				case UPDATE: return "UPDATE";
+				case SCAN: return "SCAN";
+				case READ_MODIFY_WRITE: return "READ_MODIFY_WRITE";
+				default: return "UNKNOWN";
+			}
+		}
+};
+
+// Reads the text format, one "[READ|INSERT]\t<KEY>" per line. f is called
+// with every op in order.
+template<class F>
+void for_each_text_op(const std::string &fname, F f) {
+	std::ifstream ifs(fname);
+	if (!ifs)
+		throw std::runtime_error("cannot open "s + fname);
+	std::string op;
+	long key;
+	while (ifs >> op >> key)
+		f(Operation(op, key));
+	if (!ifs.eof())
+		throw std::runtime_error("malformed workload "s + fname);
+}
+
+inline std::vector<Operation> read_workload(const std::string &fname) {
+	std::vector<Operation> ops {};
+	for_each_text_op(fname, [&] (const Operation &op) {
+		ops.push_back(op);
+	});
+	return ops;
+}
+
+
+// Binary trace layout, all little endian:
+//   WorkloadHeader
+//   op types, op_bits bits each, packed into 64 bit words
+//   keys, one int64 each
+struct WorkloadHeader {
+	static constexpr char MAGIC[8] = {'B','T','R','E','E','W','L','1'};
+
+	char magic[8];
+	uint32_t op_bits;
+	uint32_t reserved;
+	uint64_t num_ops;
+
+	static uint64_t type_words(uint64_t num_ops, uint32_t op_bits) {
+		return (num_ops * op_bits + 63) / 64;
+	}
+	uint64_t file_size() const {
+		return sizeof(WorkloadHeader) + type_words(num_ops, op_bits) * 8 + num_ops * 8;
+	}
+};
+
+// whether fname starts with the binary trace magic
+inline bool is_binary_workload(const std::string &fname) {
+	std::ifstream ifs(fname, std::ios::binary);
+	char magic[8];
+	return ifs.read(magic, sizeof(magic)) &&
+		!std::memcmp(magic, WorkloadHeader::MAGIC, sizeof(magic));
+}
+
+// Collects ops and writes them as a binary trace. Op types are kept a byte
+// each until write() packs them, at the narrowest width that fits.
+class WorkloadWriter {
+	std::vector<uint8_t> types;
+	std::vector<int64_t> keys;
+
+	public:
+		void add(const Operation &op) {
+			// the format has no room for scan lengths
+			if (op.get_op_type() == Operation::SCAN)
+				throw std::runtime_error("scans cannot be stored in a binary workload");
+			types.push_back(op.get_op_type());
+			keys.push_back(op.get_key());
+		}
+
+		size_t size() const {
+			return keys.size();
+		}
+
+		void write(const std::string &fname) const {
+			uint8_t max_type = 0;
+			for (uint8_t t : types)
+				max_type = std::max(max_type, t);
+			WorkloadHeader h {};
+			std::memcpy(h.magic, WorkloadHeader::MAGIC, sizeof(h.magic));
+			h.op_bits = 1;
+			while ((1u << h.op_bits) <= max_type)
+				h.op_bits *= 2;
+			h.num_ops = keys.size();
+
+			std::vector<uint64_t> words(WorkloadHeader::type_words(h.num_ops, h.op_bits));
+			for (uint64_t i = 0; i < h.num_ops; ++i) {
+				const uint64_t bit = i * h.op_bits;
+				words[bit / 64] |= (uint64_t)types[i] << (bit % 64);
+			}
+
+			std::ofstream ofs(fname, std::ios::binary | std::ios::trunc);
+			ofs.write(reinterpret_cast<const char *>(&h), sizeof(h));
+			ofs.write(reinterpret_cast<const char *>(words.data()), words.size() * 8);
+			ofs.write(reinterpret_cast<const char *>(keys.data()), keys.size() * 8);
+			if (!ofs)
+				throw std::runtime_error("cannot write "s + fname);
+		}
+};
+
+// A binary trace mapped read only. Ops are decoded in place, nothing is
+// copied. The mapping is populated up front so that page faults land in
+// loading and not in the timed run.
+class MappedWorkload {
+	void *base;
+	size_t length;
+	uint32_t op_bits;
+	uint64_t mask;
+	uint64_t num_ops;
+	const uint64_t *types;
+	const int64_t *keys;
+
+	public:
+		explicit MappedWorkload(const std::string &fname) {
+			const int fd = open(fname.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error("cannot open "s + fname);
+			struct stat st;
+			if (fstat(fd, &st) || (size_t)st.st_size < sizeof(WorkloadHeader)) {
+				close(fd);
+				throw std::runtime_error("truncated workload "s + fname);
+			}
+			length = st.st_size;
+			base = mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+			close(fd);
+			if (base == MAP_FAILED)
+				throw std::runtime_error("cannot map "s + fname);
+
+			const WorkloadHeader &h = *static_cast<const WorkloadHeader *>(base);
+			if (std::memcmp(h.magic, WorkloadHeader::MAGIC, sizeof(h.magic)) ||
+					!h.op_bits || h.op_bits > 8 || (h.op_bits & (h.op_bits - 1)) ||
+					h.file_size() != length) {
+				munmap(base, length);
+				throw std::runtime_error("not a binary workload "s + fname);
+			}
+			op_bits = h.op_bits;
+			mask = (1UL << op_bits) - 1;
+			num_ops = h.num_ops;
+			types = reinterpret_cast<const uint64_t *>(static_cast<const char *>(base) + sizeof(WorkloadHeader));
+			keys = reinterpret_cast<const int64_t *>(types + WorkloadHeader::type_words(num_ops, op_bits));
+		}
+
+		MappedWorkload(const MappedWorkload &) = delete;
+		MappedWorkload &operator=(const MappedWorkload &) = delete;
+
+		~MappedWorkload() {
+			munmap(base, length);
+		}
+
+		size_t size() const {
+			return num_ops;
+		}
+
+		long get_op_type(size_t i) const {
+			const uint64_t bit = i * op_bits;
+			return (types[bit / 64] >> (bit % 64)) & mask;
+		}
+
+		long get_key(size_t i) const {
+			return keys[i];
+		}
+
+		Operation operator[](size_t i) const {
+			return Operation(get_op_type(i), get_key(i));
+		}
+};
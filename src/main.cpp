@@ -4,190 +4,387 @@
 #include <vector>
 #include <locale>
 #include <string>
+#include <sstream>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <map>
+#include <set>
 #include "omp.h"
 #include "./opt_btree/BTreeOLC.h"
 #include "./opt_btree/BufferBTree.h"
 #include "./opt_btree/LockingBufferBTree.h"
 #include "./opt_btree/RingBufferBTree.h"
 #include "./opt_btree/IndBufferBTree.h"
+#include "./opt_btree/HotBufferBTree.h"
+#include "./opt_btree/CompressedLeaf.h"
+#include "./opt_btree/CountedBTree.h"
 
-using namespace std::string_literals;
+#include "./harness/Workload.h"
+#include "./harness/Generator.h"
+#include "./harness/Histogram.h"
+#include "./harness/Options.h"
+#include "./harness/Verify.h"
+#include "./harness/PerfCounters.h"
+#include "./harness/Phases.h"
+#include "./harness/OpenLoop.h"
 
 #ifndef OMP_MODE
 #define OMP_MODE dynamic,1
 #endif
 
-class Operation {
-	public:
-		static const long INSERT = 0;
-		static const long READ = 1;
+// scan results of one thread
+struct ScanBuffer {
+	std::vector<long> keys, vals;
+};
+
+template<class Tree>
+void apply_op(Tree &tree, const Operation &op, ScanBuffer &buf) {
+	const long k = op.get_key();
+	long v;
 
-	private:
-		long op_type, key;
+	switch (op.get_op_type()) {
+		case Operation::INSERT:
+		case Operation::UPDATE:
+			tree.insert(k, k);
+			break;
+		case Operation::READ:
+			tree.lookup(k, v);
+			break;
+		case Operation::SCAN:
+			if (buf.keys.size() < (size_t)op.get_len()) {
+				buf.keys.resize(op.get_len());
+				buf.vals.resize(op.get_len());
+			}
+			tree.scan(k, op.get_len(), buf.keys.data(), buf.vals.data());
+			break;
+		case Operation::READ_MODIFY_WRITE:
+			tree.lookup(k, v);
+			tree.insert(k, k);
+			break;
+	};
+}
+
+struct PhaseResult {
+	std::string name;
+	bool measured;
+	size_t ops;
+	long nanos;
+	// ops done per sampling interval
+	std::vector<long> samples;
+};
+
+struct RunResult {
+	// ops run in measured phases, over the time they took
+	double ops;
+	double ops_per_sec;
+	LatencyRecorder latency;
+	// whether the tree held what was written, if checked
+	std::optional<bool> verified;
+	// ops recorded for the linearizability check and the anomalies in them
+	size_t history_ops = 0;
+	long violations = 0;
+	// hardware counters summed over the threads
+	PerfCounters::Counts perf;
+	std::vector<PhaseResult> phases;
+	// interval of the phases' samples, 0 if none were taken
+	long sample_ms = 0;
+};
 
+// Runs one phase in parallel with omp and returns the nanoseconds it took.
+// Only measured phases add to the run's latencies and counters. ops is a
+// std::vector<Operation>, a MappedWorkload, a WorkloadGenerator or a
+// GeneratorLoad.
+template<class Tree, class W>
+long run_phase(Tree &tree, const W &ops, bool measured, const Options &opts, RunResult &res,
+		History *history, Sampler &sampler) {
+	Dispatcher dispatcher(ops.size(), opts.dispatch, opts.chunk);
+	const bool open_loop = measured && opts.rate > 0;
+	std::chrono::steady_clock::time_point begin;
 
-	public:
-		Operation(const std::string &op, long key) : key(key) {
-			if (op == "INSERT"s) 
-				op_type = INSERT;
-			else if(op == "READ"s) 
-				op_type = READ;
+	#pragma omp parallel
+	{
+		const int tid = omp_get_thread_num();
+		opts.affinity.pin(tid);
+		ScanBuffer buf;
+		LatencyRecorder rec(measured ? opts.latency_sample : 0, tid + 1);
+		std::optional<History::Log> log;
+		if (history)
+			log.emplace(*history, tid);
+		// opened before the ops start, so the syscalls stay out of the
+		// counts
+		std::optional<PerfCounters> perf;
+		if (measured && opts.perf)
+			perf.emplace();
+		// the clock starts once every thread is pinned and set up
+		#pragma omp barrier
+		#pragma omp master
+		begin = std::chrono::steady_clock::now();
+		#pragma omp barrier
+		std::optional<Pacer> pacer;
+		if (open_loop)
+			pacer.emplace(begin, opts.rate, tid, omp_get_num_threads(), opts.arrival, opts.burst);
+		auto run = [&] (const Operation &op) {
+			auto apply = [&] {
+				if (log && log->tracks(op))
+					log->apply(tree, op);
+				else
+					apply_op(tree, op, buf);
+			};
+			if (pacer)
+				rec.time_since(op.get_op_type(), pacer->wait(), apply);
 			else
-				throw std::runtime_error("Unknown op type "s + op);
+				rec.time(op.get_op_type(), apply);
+			if (sampler.enabled())
+				sampler.count(tid);
+		};
+		if (perf)
+			perf->start();
+		if constexpr (requires { ops.stream(); }) {
+			auto stream = ops.stream(Dispatcher::stream_chunk(opts.dispatch, opts.chunk));
+			Operation op;
+			while (stream.next(op))
+				run(op);
+		} else {
+			auto cursor = dispatcher.cursor(tid, omp_get_num_threads());
+			size_t i;
+			while (cursor.next(i))
+				run(ops[i]);
 		}
-
-		long get_op_type() const {
-			return op_type;
+		if (perf)
+			perf->stop();
+		#pragma omp critical
+		{
+			res.latency.merge(rec);
+			if (perf)
+				res.perf.merge(perf->read());
 		}
+		if (log)
+			history->merge(*log);
+	}
+	const auto finish = std::chrono::steady_clock::now();
+	opts.affinity.unpin();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(finish-begin).count();
+}
+
+template<class Tree>
+RunResult execute_workload(Tree &tree, const PhasedWorkload &workload, const Options &opts) {
+	RunResult res {0, 0, LatencyRecorder(opts.latency_sample)};
+	std::unique_ptr<History> history;
+	if (opts.history)
+		history.reset(new History(opts.history));
 
-		long get_key() const {
-			return key;
+	workload.rewind();
+	const auto &phases = workload.phases();
+	Sampler sampler(opts.sample_ms, omp_get_max_threads(), phases.size());
+	long s = 0;
+	for (size_t i = 0; i < phases.size(); ++i) {
+		const PhasedWorkload::Phase &p = phases[i];
+		sampler.enter(i);
+		const long nanos = std::visit([&] (auto *ops) {
+			return run_phase(tree, *ops, p.measured, opts, res, history.get(), sampler);
+		}, p.ops);
+		const size_t n = std::visit([] (auto *ops) { return (size_t)ops->size(); }, p.ops);
+		std::cerr << p.name << " : " << nanos << " nanoseconds" << (p.measured ? "" : ", not measured") << '\n';
+		res.phases.push_back({p.name, p.measured, n, nanos, {}});
+		if (p.measured) {
+			res.ops += n;
+			s += nanos;
 		}
-};
+	}
+	sampler.stop();
+	for (size_t i = 0; i < phases.size(); ++i)
+		res.phases[i].samples = sampler.samples(i);
+	res.sample_ms = opts.sample_ms;
+	std::cerr << "total time : " << s << " nanoseconds\n";
+
+	if (opts.perf && !res.perf.any())
+		std::cerr << "hardware counters unavailable, see /proc/sys/kernel/perf_event_paranoid\n";
 
-std::vector<Operation> read_workload(const std::string &fname) {
-	std::ifstream ifs(fname);
-	std::vector<Operation> ops {};
-	std::string op;
-	long key;
-	// format [READ|INSERT] <KEY>
-	while(!ifs.eof()) {
-		ifs >> op >> key;
-		ops.emplace_back(op, key);
+	if (opts.verify) {
+		std::cerr << "Verifying results...";
+		// sampled keys hold the values of the history instead of their key
+		res.verified = verify(tree, written_keys(workload), [&] (long k) {
+			return history && history->tracks(k);
+		});
+		std::cerr << (*res.verified ? "ok\n" : "FAILED\n");
+	}
+	if (history) {
+		std::cerr << "Checking history...";
+		res.history_ops = history->size();
+		res.violations = history->check(tree);
+		std::cerr << (res.violations ? "FAILED\n" : "ok\n");
 	}
 
-	return ops;
+	res.ops_per_sec = s ? res.ops * 1000000000 / s : 0;
+	return res;
 }
 
-template<typename K, typename V, template <typename, typename> class T>
-bool verify(T<K,V> &tree, const std::vector<Operation> &ops) {
-	V result;
-	bool passed = true;
-	for (const auto &op : ops) {
-		const long k = op.get_key();
-
-		switch (op.get_op_type()) {
-			case Operation::INSERT:
-				if (!tree.lookup(k, result)) {
-					std::cerr << "Key missing : " << k << '\n';
-					tree.lookup(k, result);
-					passed = false;
-					break;
-				}
-				if (result != k) {
-					std::cerr << "Unexpected value from lookup : {key = " << k
-							<< ", value = " << result << "}\n";
-					passed = false;
-				}
-				break;
-		};
-
-		if (!passed)
-			break;
+// one JSON line per run on stdout, built apart from std::cout so that its
+// locale does not group the digits
+void report(const std::string &algor, const std::string &fname, int rep, const Options &opts, const RunResult &res) {
+	std::cerr << "ops per second : "<< (long)res.ops_per_sec << "\n\n";
+	std::ostringstream os;
+	os << "{\"algor\":\"" << algor << "\",\"workload\":\"" << fname <<
+		"\", \"ops_per_sec\":" << res.ops_per_sec << ",\"num_threads\":" << omp_get_max_threads() << ",\"rep\":" << rep
+		<< ",\"dispatch\":\"" << dispatch_name(opts.dispatch) << '"';
+	if (opts.rate)
+		os << ",\"target_rate\":" << opts.rate << ",\"arrival\":\"" << arrival_name(opts.arrival) << '"';
+	if (res.verified)
+		os << ",\"verified\":" << (*res.verified ? "true" : "false");
+	if (res.history_ops)
+		os << ",\"history_ops\":" << res.history_ops << ",\"violations\":" << res.violations;
+	if (res.perf.any()) {
+		os << ",\"perf_per_op\":";
+		res.perf.print_json(os, res.ops);
+	}
+	if (res.latency.enabled()) {
+		os << ",\"latency_ns\":";
+		res.latency.print_json(os);
+	}
+	if (res.sample_ms)
+		os << ",\"sample_ms\":" << res.sample_ms;
+	os << ",\"phases\":[";
+	for (size_t i = 0; i < res.phases.size(); ++i) {
+		const PhaseResult &p = res.phases[i];
+		os << (i ? "," : "") << "{\"name\":\"" << p.name << "\",\"measured\":" << (p.measured ? "true" : "false")
+			<< ",\"ops\":" << p.ops << ",\"nanos\":" << p.nanos << ",\"samples\":[";
+		for (size_t j = 0; j < p.samples.size(); ++j)
+			os << (j ? "," : "") << p.samples[j];
+		os << "]}";
 	}
-	return passed;
+	os << ']';
+	os << "}\n";
+	std::cout << os.str();
 }
 
+// the highest open-loop rate at which a tree kept its p99 latency under the
+// SLO, in every run at that rate and every rate below
+void report_sustainable(const std::string &algor, const std::string &fname, const Options &opts, double rate) {
+	std::cerr << algor << " sustains " << (long)rate << " ops per second\n\n";
+	std::ostringstream os;
+	os << "{\"algor\":\"" << algor << "\",\"workload\":\"" << fname << "\",\"num_threads\":" << omp_get_max_threads()
+		<< ",\"arrival\":\"" << arrival_name(opts.arrival) << "\",\"slo_us\":" << opts.slo_us
+		<< ",\"sustainable_rate\":" << rate << "}\n";
+	std::cout << os.str();
+}
 
-template<typename K, typename V, template <typename, typename> class T>
-double execute_workload(T<K,V> &tree, const std::vector<Operation> &ops) {
-	auto start = std::chrono::high_resolution_clock::now();
-	// run in parallel with omp
-	std::atomic<size_t> curr_op = 0;
+// one run of every tree, each on a fresh tree, returns the p99 latency of
+// every tree's run
+std::vector<std::pair<std::string, uint64_t>> run_trees(const std::string &fname, const PhasedWorkload &workload, const Options &opts, int rep) {
+	std::vector<std::pair<std::string, uint64_t>> p99s;
+	auto done = [&] (const std::string &algor, const RunResult &res) {
+		report(algor, fname, rep, opts, res);
+		p99s.push_back({algor, res.latency.all().percentile(0.99)});
+	};
 
-	#pragma omp parallel
+	std::cerr << "running baseline\n";
 	{
-		size_t i;
-		while ((i = curr_op++) < ops.size()) {
-			const Operation &op = ops[i];
-			const long k = op.get_key();
-			long v;
-
-			switch (op.get_op_type()) {
-				case Operation::INSERT:
-					tree.insert(k, k);
-					break;
-				case Operation::READ:
-					bool success = tree.lookup(k, v);
-					break;
-			};
-		}
+	btreeolc::BTree<long, long> tree {};
+	
+	done("baseline", execute_workload(tree, workload, opts));
+	}
 
-		if constexpr( std::is_same< T<K,V>, RingBufferedBTree<long, long> >::value) {
-			tree.release_locks();
-		}
+	{
+	std::cerr << "running BufferedBTree\n";
+	BufferedBTree<long, long> buffered_tree {};
+	
+	done("BufferedBTree", execute_workload(buffered_tree, workload, opts));
 	}
-    auto finish = std::chrono::high_resolution_clock::now();
-	auto s = std::chrono::duration_cast<std::chrono::nanoseconds>(finish-start).count();
-	std::cerr << "total time : " << s << " nanoseconds\n";
 
-	std::cerr << "skipping verifying\n"; 
-	//std::cerr << "Verifying results...";
-	//bool pass = verify(tree, ops);
-	//if (pass)
-	//	std::cerr << "ok\n";
-	//else
-	//	std::cerr << "FAILED\n";
+	{
+	std::cerr << "running LockingBufferedBTree\n";
+	LockingBufferedBTree<long, long> buffered_tree {};
+	
+	done("LockingBufferedBTree", execute_workload(buffered_tree, workload, opts));
+	}
+	{
+	std::cerr << "running HotBufferedBTree\n";
+	HotBufferedBTree<long, long> hot_buffer_tree {};
 
-	return ops.size() * 1000000000 / s;
+	done("HotBufferedBTree", execute_workload(hot_buffer_tree, workload, opts));
+	}
+	{
+	std::cerr << "running RingBufferBTree\n";
+	RingBufferedBTree<long, long> ring_buffer_tree {};
+	
+	done("RingBufferedBTree", execute_workload(ring_buffer_tree, workload, opts));
+	}
+	{
+	std::cerr << "running RingBufferedBTreeCompressed\n";
+	RingBufferedBTree<long, long, CompressedLeaf<long, long>> compressed_tree {};
+
+	done("RingBufferedBTreeCompressed", execute_workload(compressed_tree, workload, opts));
+	}
+	{
+	// new keys and removes add to a count on every level, atomically
+	std::cerr << "running CountedBTree\n";
+	btreeolc::CountedBTree<long, long> counted_tree {};
+
+	done("CountedBTree", execute_workload(counted_tree, workload, opts));
+	}
+	{
+	std::cerr << "running IndBufferedBTree\n";
+	IndBufferedBTree<long, long> ind_buffer_tree {};
+
+	done("IndBufferedBTree", execute_workload(ind_buffer_tree, workload, opts));
+	}
+	return p99s;
+}
+
+// every tree reps times for every thread count of the sweep
+void run_all(const std::string &fname, const PhasedWorkload &workload, const Options &opts) {
+	std::cerr << "number of ops in workload : " << workload.size() << '\n';	
+	std::vector<int> threads = opts.threads;
+	if (threads.empty())
+		threads.push_back(omp_get_max_threads());
+	for (int t : threads) {
+		omp_set_num_threads(t);
+		std::cerr << "omp max thread number : " << omp_get_max_threads() << '\n';
+		if (opts.rates.empty()) {
+			for (int rep = 0; rep < opts.reps; ++rep)
+				run_trees(fname, workload, opts, rep);
+			continue;
+		}
+		// open loop, latencies are always recorded to judge the rates by
+		Options o = opts;
+		o.latency_sample = std::max(opts.latency_sample, 1L);
+		std::vector<std::string> algors;
+		std::map<std::string, double> sustained;
+		std::set<std::string> failed;
+		for (double r : opts.rates) {
+			o.rate = r;
+			for (int rep = 0; rep < opts.reps; ++rep) {
+				for (const auto &[algor, p99] : run_trees(fname, workload, o, rep)) {
+					if (!sustained.count(algor)) {
+						algors.push_back(algor);
+						sustained[algor] = 0;
+					}
+					if (p99 > opts.slo_us * 1000)
+						failed.insert(algor);
+				}
+			}
+			for (const std::string &algor : algors) {
+				if (!failed.count(algor))
+					sustained[algor] = r;
+			}
+		}
+		for (const std::string &algor : algors)
+			report_sustainable(algor, fname, opts, sustained[algor]);
+	}
 }
 
 int main(int argc, char **argv) {
-	if (argc != 2) {
-		std::cerr << "usage <workload file>";
+	Options opts;
+	if (!opts.parse(argc, argv)) {
+		Options::usage();
 		return 1;
 	}
 	// show commas
 	std::cout.imbue(std::locale(""));
 	std::cerr.imbue(std::locale(""));
 	
-	std::string fname = argv[1];
-	auto workload = read_workload(fname);
-	std::cerr << "omp max thread number : " << omp_get_max_threads() << '\n';
-	std::cerr << "number of ops in workload : " << workload.size() << '\n';	
-	
-	std::cerr << "running baseline\n";
-	{
-	btreeolc::BTree<long, long> tree {};
-	
-	double ops = execute_workload(tree, workload);
-	std::cerr << "ops per second : "<< (long)ops << "\n\n";
-	std::cout << "{\"algor\":\"baseline\",\"workload\":\"" << fname << 
-		"\", \"ops_per_sec\":" << ops << ",\"num_threads\":" << omp_get_max_threads() << "}\n";
-	}
-
-	//{
-	//std::cerr << "running BufferedBTree\n";
-	//BufferedBTree<long, long> buffered_tree {};
-	//
-	//double ops = execute_workload(buffered_tree, workload);
-	//std::cout << "ops per second : "<< (long)ops << "\n\n";
-	//}
-
-	//{
-	//std::cerr << "running IndBufferedBTree\n";
-	//IndBufferedBTree<long, long> buffered_tree {};
-	//
-	//double ops = execute_workload(buffered_tree, workload);
-	//std::cout << "ops per second : "<< (long)ops << "\n\n";
-	//}
-	//{
-	//std::cerr << "running LockingBufferedBTree\n";
-	//LockingBufferedBTree<long, long> buffered_tree {};
-	//
-	//double ops = execute_workload(buffered_tree, workload);
-	//std::cout << "ops per second : "<< (long)ops << "\n\n";
-	//}
-	{
-	std::cerr << "running RingBufferBTree\n";
-	RingBufferedBTree<long, long> ring_buffer_tree {};
-	
-	double ops = execute_workload(ring_buffer_tree, workload);
-	std::cerr << "ops per second : "<< (long)ops << "\n\n";
-
-	std::cout << "{\"algor\":\"RingBufferedBTree\",\"workload\":\"" << fname << 
-		"\", \"ops_per_sec\":" << ops << ",\"num_threads\":" << omp_get_max_threads() << "}\n";
-	}
+	const std::string &fname = opts.workload;
+	run_all(fname, PhasedWorkload(fname), opts);
 	return 0;
 }
-
@@ -0,0 +1,405 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include "./opt_btree/BTreeOLC.h"
+#include "./opt_btree/RingBufferBTree.h"
+#include "./opt_btree/CompressedLeaf.h"
+
+// Microbenchmarks of the node-level kernels the trees are built on, each
+// timed on its own in a single thread, across fill levels, key types and
+// payload sizes. One JSON line per measurement on stdout, the same way the
+// benchmark driver reports runs. "./micro <filter>" runs only the kernels
+// whose name contains filter.
+
+using Clock = std::chrono::steady_clock;
+
+// a measurement runs for at least this long, REPS times
+static constexpr long MIN_NS = 20000000;
+static constexpr int REPS = 5;
+// nodes a batch works on, together about the size of L2
+static constexpr int BATCH = 256;
+// working set of the cold variants, well past the LLC
+static constexpr size_t COLD_BYTES = 64UL << 20;
+static constexpr int PROBES = 4096;
+
+// makes v look used, so that the kernels are not optimized away
+template<class T>
+inline void keep(const T &v) {
+	asm volatile("" : : "g"(v) : "memory");
+}
+
+// payload of N bytes
+template<int N>
+struct Bytes {
+	char b[N];
+
+	Bytes() = default;
+	Bytes(long v) {
+		std::memset(b, 0, N);
+		std::memcpy(b, &v, std::min<size_t>(N, sizeof(v)));
+	}
+};
+
+template<class T> struct type_name { static constexpr const char *value = "?"; };
+template<> struct type_name<int32_t> { static constexpr const char *value = "int32"; };
+template<> struct type_name<int64_t> { static constexpr const char *value = "int64"; };
+
+struct Result {
+	// median and best of the reps
+	double ns_per_op;
+	double min_ns_per_op;
+};
+
+// Calls setup untimed, then run, which returns the ops it did, until
+// MIN_NS of run have passed, REPS times over.
+template<class Setup, class Run>
+Result measure(Setup setup, Run run) {
+	std::vector<double> reps;
+	for (int r = 0; r < REPS; ++r) {
+		long ns = 0, ops = 0;
+		while (ns < MIN_NS) {
+			setup();
+			const auto start = Clock::now();
+			ops += run();
+			ns += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		}
+		reps.push_back((double)ns / ops);
+	}
+	std::sort(reps.begin(), reps.end());
+	return {reps[REPS / 2], reps[0]};
+}
+
+// one line, fields holds the measurement's parameters
+void report(const std::string &kernel, const std::string &fields, const Result &r) {
+	std::ostringstream os;
+	os << "{\"kernel\":\"" << kernel << "\"," << fields << ",\"ns_per_op\":" << r.ns_per_op
+		<< ",\"min_ns_per_op\":" << r.min_ns_per_op << "}\n";
+	std::cout << os.str() << std::flush;
+}
+
+template<class K, class P>
+std::string params(double fill, long entries) {
+	std::ostringstream os;
+	os << "\"key\":\"" << type_name<K>::value << "\",\"payload_bytes\":" << sizeof(P)
+		<< ",\"fill\":" << fill << ",\"entries\":" << entries;
+	return os.str();
+}
+
+// leaves hold no state but keys, payloads and count
+template<class Leaf>
+void copy_leaf(Leaf &dst, const Leaf &src) {
+	dst.count = src.count;
+	std::memcpy(dst.keys, src.keys, sizeof(src.keys[0]) * src.count);
+	std::memcpy(dst.payloads, src.payloads, sizeof(src.payloads[0]) * src.count);
+}
+
+static const double FILLS[] = {0.25, 0.5, 0.75, 1.0};
+
+static unsigned entries_at(double fill, unsigned max) {
+	return std::max(1u, (unsigned)(fill * max));
+}
+
+template<class K, class P>
+void leaf_lower_bound(std::mt19937_64 &rng) {
+	using Leaf = BTreeLeaf<K, P>;
+	for (const bool cold : {false, true}) {
+		const size_t n = cold ? COLD_BYTES / sizeof(Leaf) : 1;
+		std::unique_ptr<Leaf[]> leaves(new Leaf[n]);
+		for (double fill : FILLS) {
+			const unsigned count = entries_at(fill, Leaf::maxEntries);
+			// even keys, probes hit about half the time
+			for (size_t l = 0; l < n; ++l) {
+				leaves[l].count = count;
+				for (unsigned i = 0; i < count; ++i)
+					leaves[l].keys[i] = 2 * i;
+			}
+			std::vector<std::pair<size_t, K>> probes(PROBES);
+			for (auto &p : probes)
+				p = {rng() % n, (K)(rng() % (2 * count))};
+			for (const bool bf : {false, true}) {
+				const Result r = measure([] {}, [&] {
+					uint64_t s = 0;
+					for (const auto &[l, k] : probes)
+						s += bf ? leaves[l].lowerBoundBF(k) : leaves[l].lowerBound(k);
+					keep(s);
+					return (long)PROBES;
+				});
+				report("leaf_lower_bound", params<K, P>(fill, count) + ",\"variant\":\"" + (bf ? "branchless" : "binary")
+					+ "\",\"nodes\":\"" + (cold ? "cold" : "hot") + '"', r);
+			}
+		}
+	}
+}
+
+// leaf_lower_bound for the compressed leaf, in every encoding. Keys are
+// stride apart, the stride picks the encoding, probes hit about 1/stride
+// of the time. int32 keys have no 32 bit deltas, the run is skipped.
+template<class K, class P>
+void compressed_leaf_lower_bound(std::mt19937_64 &rng) {
+	using Leaf = CompressedLeaf<K, P>;
+	using Mode = typename Leaf::Mode;
+	static const char *NAMES[] = {"dense", "delta16", "delta32", "wide"};
+	const std::pair<Mode, uint64_t> modes[] = {
+		{Mode::Dense, 1}, {Mode::Delta16, 2}, {Mode::Delta32, 1 << 10},
+		{Mode::Wide, sizeof(K) > 4 ? 1UL << 33 : 1 << 20}};
+	for (const auto &[mode, stride] : modes) {
+		if (mode == Mode::Delta32 && sizeof(K) <= 4)
+			continue;
+		for (const bool cold : {false, true}) {
+			const size_t n = cold ? COLD_BYTES / sizeof(Leaf) : 1;
+			std::unique_ptr<Leaf[]> leaves(new Leaf[n]);
+			for (double fill : FILLS) {
+				const unsigned count = entries_at(fill, Leaf::capacity(mode));
+				std::vector<K> keys(count);
+				std::vector<P> payloads(count);
+				for (unsigned i = 0; i < count; ++i) {
+					keys[i] = (K)(stride * i);
+					payloads[i] = P(i);
+				}
+				for (size_t l = 0; l < n; ++l)
+					leaves[l].rebuild(keys.data(), payloads.data(), count);
+				std::vector<std::pair<size_t, K>> probes(PROBES);
+				for (auto &p : probes)
+					p = {rng() % n, (K)(rng() % (stride * count))};
+				const Result r = measure([] {}, [&] {
+					uint64_t s = 0;
+					for (const auto &[l, k] : probes)
+						s += leaves[l].lowerBound(k);
+					keep(s);
+					return (long)PROBES;
+				});
+				report("compressed_leaf_lower_bound", params<K, P>(fill, count) + ",\"mode\":\"" + NAMES[(int)mode]
+					+ "\",\"nodes\":\"" + (cold ? "cold" : "hot") + '"', r);
+			}
+		}
+	}
+}
+
+// leaves at fill take one new key each, at a random position
+template<class K, class P>
+void leaf_insert(std::mt19937_64 &rng) {
+	using Leaf = BTreeLeaf<K, P>;
+	std::unique_ptr<Leaf[]> leaves(new Leaf[BATCH]);
+	Leaf full;
+	for (double fill : FILLS) {
+		const unsigned count = std::min<unsigned>(entries_at(fill, Leaf::maxEntries), Leaf::maxEntries - 1);
+		full.count = count;
+		for (unsigned i = 0; i < count; ++i) {
+			full.keys[i] = 2 * i;
+			full.payloads[i] = P(i);
+		}
+		std::vector<K> probes(BATCH);
+		for (K &k : probes)
+			k = 2 * (rng() % (count + 1)) - 1;
+		const Result r = measure([&] {
+			for (int l = 0; l < BATCH; ++l)
+				copy_leaf(leaves[l], full);
+		}, [&] {
+			for (int l = 0; l < BATCH; ++l)
+				leaves[l].insert(probes[l], P(l));
+			return (long)BATCH;
+		});
+		report("leaf_insert", params<K, P>(fill, count), r);
+	}
+}
+
+// full leaves split in two, the new leaf's allocation included as in the
+// tree
+template<class K, class P>
+void leaf_split(std::mt19937_64 &) {
+	using Leaf = BTreeLeaf<K, P>;
+	std::unique_ptr<Leaf[]> leaves(new Leaf[BATCH]);
+	std::vector<Leaf *> split(BATCH, nullptr);
+	Leaf full;
+	full.count = Leaf::maxEntries;
+	for (unsigned i = 0; i < full.count; ++i) {
+		full.keys[i] = i;
+		full.payloads[i] = P(i);
+	}
+	const Result r = measure([&] {
+		for (int l = 0; l < BATCH; ++l) {
+			delete split[l];
+			copy_leaf(leaves[l], full);
+		}
+	}, [&] {
+		K sep;
+		for (int l = 0; l < BATCH; ++l)
+			split[l] = leaves[l].split(sep);
+		keep(sep);
+		return (long)BATCH;
+	});
+	for (Leaf *l : split)
+		delete l;
+	report("leaf_split", params<K, P>(1.0, Leaf::maxEntries), r);
+}
+
+template<class K>
+void inner_split(std::mt19937_64 &) {
+	using Inner = BTreeInner<K>;
+	std::unique_ptr<Inner[]> inners(new Inner[BATCH]);
+	std::vector<Inner *> split(BATCH, nullptr);
+	const unsigned count = Inner::maxEntries - 1;
+	const Result r = measure([&] {
+		for (int l = 0; l < BATCH; ++l) {
+			delete split[l];
+			Inner &n = inners[l];
+			n.count = count;
+			for (unsigned i = 0; i <= count; ++i) {
+				n.keys[i] = i;
+				n.children[i] = nullptr;
+			}
+		}
+	}, [&] {
+		K sep;
+		for (int l = 0; l < BATCH; ++l)
+			split[l] = inners[l].split(sep);
+		keep(sep);
+		return (long)BATCH;
+	});
+	for (Inner *n : split)
+		delete n;
+	report("inner_split", params<K, NodeBase *>(1.0, count), r);
+}
+
+// unsorted leaves as BufferedBTree fills them, with a fraction dup of the
+// entries repeating a key
+template<class K, class P>
+void sort_and_dedupe(std::mt19937_64 &rng) {
+	using Leaf = BTreeLeaf<K, P>;
+	std::unique_ptr<Leaf[]> leaves(new Leaf[BATCH]);
+	Leaf unsorted;
+	for (double fill : FILLS) {
+		const unsigned count = entries_at(fill, Leaf::maxEntries);
+		for (const double dup : {0.0, 0.5}) {
+			const unsigned distinct = std::max(1u, (unsigned)(count * (1 - dup)));
+			unsorted.count = count;
+			for (unsigned i = 0; i < count; ++i) {
+				unsorted.keys[i] = i < distinct ? i : rng() % distinct;
+				unsorted.payloads[i] = P(i);
+			}
+			std::shuffle(unsorted.keys, unsorted.keys + count, rng);
+			const Result r = measure([&] {
+				for (int l = 0; l < BATCH; ++l)
+					copy_leaf(leaves[l], unsorted);
+			}, [&] {
+				for (int l = 0; l < BATCH; ++l)
+					keep(leaves[l].sort_and_dedupe());
+				return (long)BATCH;
+			});
+			std::ostringstream os;
+			os << params<K, P>(fill, count) << ",\"dup\":" << dup;
+			report("sort_and_dedupe", os.str(), r);
+		}
+	}
+}
+
+template<class K, class P>
+void search_unsorted(std::mt19937_64 &rng) {
+	using Leaf = BTreeLeaf<K, P>;
+	for (const bool cold : {false, true}) {
+		const size_t n = cold ? COLD_BYTES / sizeof(Leaf) : 1;
+		std::unique_ptr<Leaf[]> leaves(new Leaf[n]);
+		for (double fill : FILLS) {
+			const unsigned count = entries_at(fill, Leaf::maxEntries);
+			for (size_t l = 0; l < n; ++l) {
+				leaves[l].count = count;
+				for (unsigned i = 0; i < count; ++i) {
+					leaves[l].keys[i] = 2 * i;
+					leaves[l].payloads[i] = P(i);
+				}
+				std::shuffle(leaves[l].keys, leaves[l].keys + count, rng);
+			}
+			std::vector<std::pair<size_t, K>> probes(PROBES);
+			for (auto &p : probes)
+				p = {rng() % n, (K)(rng() % (2 * count))};
+			const Result r = measure([] {}, [&] {
+				uint64_t s = 0;
+				P out;
+				for (const auto &[l, k] : probes)
+					s += leaves[l].search_unsorted(k, count, out);
+				keep(s);
+				return (long)PROBES;
+			});
+			report("search_unsorted", params<K, P>(fill, count) + ",\"nodes\":\"" + (cold ? "cold" : "hot") + '"', r);
+		}
+	}
+}
+
+// the linear scan of RingBufferedBTree's insert buffer, payloads are longs
+// as its slots are atomics
+template<class K>
+void insert_buffer_search(std::mt19937_64 &rng) {
+	using Buffer = typename RingBufferedBTree<K, long>::InsertBuffer;
+	const std::atomic<K> buffered_key {std::numeric_limits<K>::min()};
+	for (const long cap : {64L, 256L, 1024L, 4096L}) {
+		for (double fill : FILLS) {
+			const long count = std::max(1L, (long)(fill * cap));
+			Buffer buf(cap);
+			buf.activate(0, cap);
+			for (long i = 0; i < count; ++i)
+				buf.push_back(2 * i, i, false, buffered_key);
+			std::vector<K> probes(PROBES);
+			for (K &k : probes)
+				k = rng() % (2 * count);
+			const Result r = measure([] {}, [&] {
+				uint64_t s = 0;
+				long scanned = 0;
+				for (const K k : probes) {
+					Versioned<long> out(0, 0);
+					s += buf.search(k, out, scanned);
+				}
+				keep(s + scanned);
+				return (long)PROBES;
+			});
+			std::ostringstream os;
+			os << params<K, long>(fill, count) << ",\"capacity\":" << cap;
+			report("insert_buffer_search", os.str(), r);
+		}
+	}
+}
+
+template<class K, class P>
+void leaf_kernels(const std::string &filter, std::mt19937_64 &rng) {
+	if (std::string("leaf_lower_bound").find(filter) != std::string::npos)
+		leaf_lower_bound<K, P>(rng);
+	if (std::string("compressed_leaf_lower_bound").find(filter) != std::string::npos)
+		compressed_leaf_lower_bound<K, P>(rng);
+	if (std::string("leaf_insert").find(filter) != std::string::npos)
+		leaf_insert<K, P>(rng);
+	if (std::string("leaf_split").find(filter) != std::string::npos)
+		leaf_split<K, P>(rng);
+	if (std::string("sort_and_dedupe").find(filter) != std::string::npos)
+		sort_and_dedupe<K, P>(rng);
+	if (std::string("search_unsorted").find(filter) != std::string::npos)
+		search_unsorted<K, P>(rng);
+}
+
+template<class K>
+void key_kernels(const std::string &filter, std::mt19937_64 &rng) {
+	leaf_kernels<K, long>(filter, rng);
+	leaf_kernels<K, Bytes<16>>(filter, rng);
+	leaf_kernels<K, Bytes<64>>(filter, rng);
+	if (std::string("inner_split").find(filter) != std::string::npos)
+		inner_split<K>(rng);
+	if (std::string("insert_buffer_search").find(filter) != std::string::npos)
+		insert_buffer_search<K>(rng);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 2) {
+		std::cerr << "usage [kernel filter]\n";
+		return 1;
+	}
+	const std::string filter = argc > 1 ? argv[1] : "";
+	std::mt19937_64 rng(42);
+	key_kernels<int32_t>(filter, rng);
+	key_kernels<int64_t>(filter, rng);
+	return 0;
+}
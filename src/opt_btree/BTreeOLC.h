@@ -104,6 +104,10 @@ struct BTreeLeaf : public BTreeLeafBase {
    }
 
    bool isFull() { return count==maxEntries; };
+   bool canInsert(Key) const { return count<maxEntries; }
+
+   Key keyAt(unsigned i) const { return keys[i]; }
+   Payload& payloadAt(unsigned i) { return payloads[i]; }
 
    unsigned lowerBound(Key k) {
       unsigned lower=0;
@@ -138,7 +142,7 @@ struct BTreeLeaf : public BTreeLeafBase {
       unsigned pos=lowerBound(k);
       if ((pos<count) && (keys[pos]==k)) {
 	// Upsert
-	if constexpr (std::is_same<Payload, Versioned<long>>::value) {
+	if constexpr (is_versioned<Payload>::value) {
 		payloads[pos].set(p);
 	} else {
 		payloads[pos] = p;
@@ -217,6 +221,12 @@ struct BTreeLeaf : public BTreeLeafBase {
 		payloads[pos] = p;
 
 	}
+
+   void erase(unsigned pos) {
+      memmove(keys+pos,keys+pos+1,sizeof(Key)*(count-pos-1));
+      memmove(payloads+pos,payloads+pos+1,sizeof(Payload)*(count-pos-1));
+      count--;
+   }
 };
 
 
@@ -224,9 +234,11 @@ struct BTreeInnerBase : public NodeBase {
    static const PageType typeMarker=PageType::BTreeInner;
 };
 
-template<class Key>
+// Entries is lower for inner nodes that keep more per child, such as
+// CountedInner.
+template<class Key,uint64_t Entries=(pageSize-sizeof(NodeBase))/(sizeof(Key)+sizeof(NodeBase*))>
 struct BTreeInner : public BTreeInnerBase {
-   static const uint64_t maxEntries=(pageSize-sizeof(NodeBase))/(sizeof(Key)+sizeof(NodeBase*));
+   static const uint64_t maxEntries=Entries;
    NodeBase* children[maxEntries];
    Key keys[maxEntries];
 
@@ -288,16 +300,20 @@ struct BTreeInner : public BTreeInnerBase {
 };
 
 
-template<class Key,class Value>
+// Leaf is the leaf format, BTreeLeaf or anything with the same interface
+// (lowerBound, keyAt, payloadAt, canInsert, insert, split, erase), such as
+// CompressedLeaf. Inner is BTreeInner or derived from one, such as
+// CountedInner.
+template<class Key,class Value,class Leaf=BTreeLeaf<Key,Value>,class Inner=BTreeInner<Key>>
 struct BTree {
   std::atomic<NodeBase*> root;
 
    BTree() {
-      root = new BTreeLeaf<Key,Value>();
+      root = new Leaf();
    }
 
    void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild) {
-      auto inner = new BTreeInner<Key>();
+      auto inner = new Inner();
       inner->count = 1;
       inner->keys[0] = k;
       inner->children[0] = leftChild;
@@ -325,11 +341,11 @@ struct BTree {
     if (needRestart || (node!=root)) goto restart;
 
     // Parent of current node
-    BTreeInner<Key>* parent = nullptr;
+    Inner* parent = nullptr;
     uint64_t versionParent;
 
     while (node->type==PageType::BTreeInner) {
-      auto inner = static_cast<BTreeInner<Key>*>(node);
+      auto inner = static_cast<Inner*>(node);
 
       // Split eagerly if full
       if (inner->isFull()) {
@@ -349,7 +365,7 @@ struct BTree {
 	  goto restart;
 	}
 	// Split
-	Key sep; BTreeInner<Key>* newInner = inner->split(sep);
+	Key sep; Inner* newInner = inner->split(sep);
 	if (parent)
 	  parent->insert(sep,newInner);
 	else
@@ -376,10 +392,10 @@ struct BTree {
       if (needRestart) goto restart;
     }
 
-    auto leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
+    auto leaf = static_cast<Leaf*>(node);
 
     // Split leaf if full
-    if (leaf->count==leaf->maxEntries) {
+    if (!leaf->canInsert(k)) {
       // Lock
       if (parent) {
 	parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
@@ -395,7 +411,7 @@ struct BTree {
 	goto restart;
       }
       // Split
-      Key sep; BTreeLeaf<Key,Value>* newLeaf = leaf->split(sep);
+      Key sep; Leaf* newLeaf = leaf->split(sep);
       if (parent)
 	parent->insert(sep, newLeaf);
       else
@@ -422,6 +438,62 @@ struct BTree {
     }
   }
 
+  // Removes k if pred(payload) holds, returns whether it did. Leaves are
+  // never merged, a leaf that runs empty stays in the tree.
+  template<class Pred>
+  bool remove_if(Key k, Pred pred) {
+    int restartCount = 0;
+  restart:
+    if (restartCount++)
+      yield(restartCount);
+    bool needRestart = false;
+
+    NodeBase* node = root;
+    uint64_t versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart || (node!=root)) goto restart;
+
+    // Parent of current node
+    Inner* parent = nullptr;
+    uint64_t versionParent;
+
+    while (node->type==PageType::BTreeInner) {
+      auto inner = static_cast<Inner*>(node);
+
+      if (parent) {
+	parent->readUnlockOrRestart(versionParent, needRestart);
+	if (needRestart) goto restart;
+      }
+
+      parent = inner;
+      versionParent = versionNode;
+
+      node = inner->children[inner->lowerBound(k)];
+      inner->checkOrRestart(versionNode, needRestart);
+      if (needRestart) goto restart;
+      versionNode = node->readLockOrRestart(needRestart);
+      if (needRestart) goto restart;
+    }
+
+    auto leaf = static_cast<Leaf*>(node);
+    node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    if (parent) {
+      parent->readUnlockOrRestart(versionParent, needRestart);
+      if (needRestart) {
+	node->writeUnlock();
+	goto restart;
+      }
+    }
+    unsigned pos = leaf->lowerBound(k);
+    bool removed = false;
+    if ((pos<leaf->count) && (leaf->keyAt(pos)==k) && pred(leaf->payloadAt(pos))) {
+      leaf->erase(pos);
+      removed = true;
+    }
+    node->writeUnlock();
+    return removed;
+  }
+
   bool lookup(Key k, Value& result) {
     int restartCount = 0;
   restart:
@@ -434,11 +506,11 @@ struct BTree {
     if (needRestart || (node!=root)) goto restart;
 
     // Parent of current node
-    BTreeInner<Key>* parent = nullptr;
+    Inner* parent = nullptr;
     uint64_t versionParent;
 
     while (node->type==PageType::BTreeInner) {
-      auto inner = static_cast<BTreeInner<Key>*>(node);
+      auto inner = static_cast<Inner*>(node);
 
       if (parent) {
 	parent->readUnlockOrRestart(versionParent, needRestart);
@@ -455,12 +527,12 @@ struct BTree {
       if (needRestart) goto restart;
     }
 
-    BTreeLeaf<Key,Value>* leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
+    Leaf* leaf = static_cast<Leaf*>(node);
     unsigned pos = leaf->lowerBound(k);
     bool success = false;
-    if ((pos<leaf->count) && (leaf->keys[pos]==k)) {
+    if ((pos<leaf->count) && (leaf->keyAt(pos)==k)) {
       success = true;
-      result = leaf->payloads[pos];
+      result = leaf->payloadAt(pos);
     }
     if (parent) {
       parent->readUnlockOrRestart(versionParent, needRestart);
@@ -484,11 +556,11 @@ struct BTree {
     if (needRestart || (node!=root)) goto restart;
 
     // Parent of current node
-    BTreeInner<Key>* parent = nullptr;
+    Inner* parent = nullptr;
     uint64_t versionParent;
 
     while (node->type==PageType::BTreeInner) {
-      auto inner = static_cast<BTreeInner<Key>*>(node);
+      auto inner = static_cast<Inner*>(node);
 
       if (parent) {
 	parent->readUnlockOrRestart(versionParent, needRestart);
@@ -505,13 +577,13 @@ struct BTree {
       if (needRestart) goto restart;
     }
 
-    BTreeLeaf<Key,Value>* leaf = static_cast<BTreeLeaf<Key,Value>*>(node);
+    Leaf* leaf = static_cast<Leaf*>(node);
     unsigned pos = leaf->lowerBound(k);
     int count = 0;
     for (unsigned i=pos; i<leaf->count; i++) {
       if (count==range)
 	break;
-      output[count++] = leaf->payloads[i];
+      output[count++] = leaf->payloadAt(i);
     }
 
     if (parent) {
@@ -524,6 +596,80 @@ struct BTree {
     return count;
   }
 
+  // Scan that continues into the following leaves, copies up to range
+  // entries with keys >= k (> k if !inclusive) into keys and output. Each
+  // leaf is read consistently, the scan as a whole is not atomic.
+  uint64_t scan(Key k, int range, Key* keys, Value* output, bool inclusive = true) {
+    int count = 0;
+    while (count < range) {
+      int restartCount = 0;
+    restart:
+      if (restartCount++)
+	yield(restartCount);
+      bool needRestart = false;
+
+      NodeBase* node = root;
+      uint64_t versionNode = node->readLockOrRestart(needRestart);
+      if (needRestart || (node!=root)) goto restart;
+
+      // Parent of current node
+      Inner* parent = nullptr;
+      uint64_t versionParent;
+      // smallest separator above the leaf, the next leaf starts after it
+      Key fence{};
+      bool hasFence = false;
+
+      while (node->type==PageType::BTreeInner) {
+	auto inner = static_cast<Inner*>(node);
+
+	if (parent) {
+	  parent->readUnlockOrRestart(versionParent, needRestart);
+	  if (needRestart) goto restart;
+	}
+
+	parent = inner;
+	versionParent = versionNode;
+
+	unsigned pos = inner->lowerBound(k);
+	if (!inclusive && (pos<inner->count) && (inner->keys[pos]==k))
+	  pos++;
+	if (pos<inner->count) {
+	  fence = inner->keys[pos];
+	  hasFence = true;
+	}
+	node = inner->children[pos];
+	inner->checkOrRestart(versionNode, needRestart);
+	if (needRestart) goto restart;
+	versionNode = node->readLockOrRestart(needRestart);
+	if (needRestart) goto restart;
+      }
+
+      Leaf* leaf = static_cast<Leaf*>(node);
+      unsigned pos = leaf->lowerBound(k);
+      if (!inclusive && (pos<leaf->count) && (leaf->keyAt(pos)==k))
+	pos++;
+      int n = count;
+      for (unsigned i=pos; i<leaf->count && n<range; i++) {
+	keys[n] = leaf->keyAt(i);
+	output[n++] = leaf->payloadAt(i);
+      }
+
+      if (parent) {
+	parent->readUnlockOrRestart(versionParent, needRestart);
+	if (needRestart) goto restart;
+      }
+      node->readUnlockOrRestart(versionNode, needRestart);
+      if (needRestart) goto restart;
+
+      count = n;
+      if (!hasFence)
+	break;
+      k = fence;
+      inclusive = false;
+    }
+    return count;
+  }
+
 
 };
 
@@ -4,6 +4,12 @@
 #include<shared_mutex>
 #include<utility>
 #include<optional>
+#include<algorithm>
+#include<limits>
+#include<memory>
+#include<immintrin.h>
+#include "MergedScan.h"
+#include "TailDirectory.h"
 
 using namespace btreeolc;
 
@@ -22,32 +28,77 @@ class BufferedBTree : public BTree<K, V> {
 			return {pos+i, low_key};
 		}
 	};
-	private:
+
+	// one unsorted tail leaf and the low key above which it takes inserts,
+	// every key prefix gets its own
+	struct alignas(64) Tail {
 		std::atomic<int> insert_count;
 		std::atomic<State> state;
 		std::atomic<BTreeLeaf<K,V> *>leaf;
+
+		Tail(BTreeLeaf<K,V> *leaf) :
+			insert_count(0), state(State(0, std::numeric_limits<K>::lowest())), leaf(leaf) {
+		}
+	};
+
+	private:
+		TailDirectory<K, Tail> tails;
 		
 		
 		BTreeLeaf<K,V> *allocate_new_leaf() {
 			auto leaf = new BTreeLeaf<K,V>();
 			leaf->count = 0;
-			// clear the memory 
-			//std::memset(leaf->keys, 0, sizeof(BTreeLeaf<K,V>::keys));
+			// tail keys are above the initial low key, scans skip slots
+			// that were reserved but not written yet
+			std::fill(std::begin(leaf->keys), std::end(leaf->keys), std::numeric_limits<K>::lowest());
 			//std::memset(leaf->payloads, 0, sizeof(BTreeLeaf<K,V>::payloads));
 			return leaf;
 		}
 		
 
 	public:
-		// 75% load factor on bulk inserted leaves
-		static const int max_inserts = BTreeLeaf<K,V>::maxEntries * .9;
+		// last slot of the tail leaf, set from the load factor of bulk
+		// inserted leaves
+		const int max_inserts;
 		
-		BufferedBTree() : state(State(0, -1)), leaf(allocate_new_leaf()) {
+		// the default prefix_shift puts every non negative key in one tail
+		BufferedBTree(const double load_factor = .9,
+				const int prefix_shift = sizeof(K) * 8 - 1, const int max_tails = 64) :
+			tails(prefix_shift, max_tails),
+			max_inserts(std::clamp<int>(BTreeLeaf<K,V>::maxEntries * load_factor, 1, BTreeLeaf<K,V>::maxEntries - 1)) {
 			this->root = nullptr;
 		}
 
+		// tail for the key's prefix, sets one up if create is set, nullptr
+		// if there is none
+		Tail *find_tail(const K key, const bool create) {
+			if (!create)
+				return tails.find(key);
+			return tails.find(key, [this] { return new Tail(allocate_new_leaf()); });
+		}
+
+		// the tree starts out empty, plain inserts need a leaf to go to
+		void ensure_root() {
+			if (!this->root.load()) {
+				NodeBase *null = nullptr;
+				auto *leaf = allocate_new_leaf();
+				if (!this->root.compare_exchange_strong(null, leaf))
+					delete leaf;
+			}
+		}
+
 		
 		void insert(K key, V payload) {
+			Tail *tail = find_tail(key, true);
+			if (!tail) {
+				ensure_root();
+				BTree<K, V>::insert(key, payload);
+				return;
+			}
+			auto &state = tail->state;
+			auto &leaf = tail->leaf;
+			auto &insert_count = tail->insert_count;
+
 			start_insert:
 			auto init_state = state.load();
 			if (key > init_state.low_key) {
@@ -95,23 +146,44 @@ class BufferedBTree : public BTree<K, V> {
 
 			} else {
 				// insert normally into the tree
+				ensure_root();
 				BTree<K, V>::insert(key, payload);
 				//std::cerr << "i " << key << '\n';
 			}
 		}
 		
 		bool lookup(const K key, V &result) {
+			Tail *tail = find_tail(key, false);
+			if (!tail) {
+				return this->root.load() && BTree<K,V>::lookup(key, result);
+			}
+			auto &state = tail->state;
+			auto &leaf = tail->leaf;
+
+			start_lookup:
 			State cs = state.load();
-			auto *current_leaf = leaf.load();
 			const K current_low_key = cs.low_key;
 
 			if (key <= current_low_key) {
-				return BTree<K,V>::lookup(key, result);
+				return this->root.load() && BTree<K,V>::lookup(key, result);
 			} 
+			if (cs.pos > max_inserts) {
+				// the tail leaf is being swapped out, leaf may already be the
+				// new empty one
+				state.wait(cs);
+				goto start_lookup;
+			}
+			auto *current_leaf = leaf.load();
 			auto count = cs.pos + 1;
 			auto res = current_leaf->search_unsorted(key, count, result);
 			//TODO what happens when the leaf is split?
-			if (current_leaf != leaf.load()) {
+			if (current_leaf == leaf.load()) {
+				State now = state.load();
+				// a swap started after cs was read, current_leaf may be the
+				// new leaf
+				if (now.low_key != cs.low_key || now.pos > max_inserts)
+					goto start_lookup;
+			} else {
 				// leaf was inserted into the tree
 				// wait for insert to complete
 				state.wait(cs);
@@ -119,7 +191,11 @@ class BufferedBTree : public BTree<K, V> {
 				// try reading the leaf
 				do {
 					needRestart = false;
-					uint64_t versionNode = current_leaf->readLockOrRestart(needRestart);
+					uint64_t versionNode = current_leaf->typeVersionLockObsolete.load();
+					if (current_leaf->isObsolete(versionNode))
+						// the leaf was copied into the tree
+						return BTree<K,V>::lookup(key, result);
+					versionNode = current_leaf->readLockOrRestart(needRestart);
 					if (needRestart)
 						continue;
 
@@ -144,6 +220,60 @@ class BufferedBTree : public BTree<K, V> {
 			return res;
 		}
 
+		// up to range entries with keys >= key in key order, including the
+		// ones in the tail leaves
+		uint64_t scan(K key, int range, K *keys, V *output) {
+			MergedScan<K,V> merged;
+			tails.for_each([this, key, &merged] (Tail &tail) {
+				start_collect:
+				State cs = tail.state.load();
+				if (cs.pos > max_inserts) {
+					// being swapped out, the entries end up in the tree
+					tail.state.wait(cs);
+					goto start_collect;
+				}
+				auto *current_leaf = tail.leaf.load();
+				const size_t m = merged.mark();
+				for (long j = 0; j < cs.pos; ++j) {
+					const K k = current_leaf->keys[j];
+					if (k > cs.low_key && k >= key)
+						merged.add(k, current_leaf->payloads[j]);
+				}
+				State now = tail.state.load();
+				if (current_leaf != tail.leaf.load() || now.low_key != cs.low_key || now.pos > max_inserts) {
+					merged.rollback(m);
+					goto start_collect;
+				}
+			});
+
+			return merged.run(key, range, [this] (K k, int r, K *ks, V *vs, bool inclusive) -> uint64_t {
+				if (!this->root.load())
+					return 0;
+				return BTree<K,V>::scan(k, r, ks, vs, inclusive);
+			}, keys, output);
+		}
+
+		uint64_t scan(K key, int range, V *output) {
+			std::unique_ptr<K[]> keys(new K[std::max(range, 1)]);
+			return scan(key, range, keys.get(), output);
+		}
+
+		// insert the entries of a sorted tail leaf one by one, lookups that
+		// still hold the leaf find it obsolete and go to the tree
+		void copy_leaf(BTreeLeaf<K, V> *new_leaf) {
+			for (unsigned i = 0; i < new_leaf->count; ++i)
+				BTree<K, V>::insert(new_leaf->keys[i], new_leaf->payloads[i]);
+			bool needRestart = false;
+			uint64_t version;
+			do {
+				needRestart = false;
+				version = new_leaf->readLockOrRestart(needRestart);
+				if (!needRestart)
+					new_leaf->upgradeToWriteLockOrRestart(version, needRestart);
+			} while (needRestart);
+			new_leaf->writeUnlockObsolete();
+		}
+
 		void insert_leaf(BTreeLeaf<K, V> *new_leaf) {
 			NodeBase *null = nullptr;
 			if (this->root.compare_exchange_strong(null, new_leaf)) {
@@ -232,6 +362,15 @@ class BufferedBTree : public BTree<K, V> {
 					goto restart;
 				}
 				auto leaf = static_cast<BTreeLeaf<K,V>*>(node);
+				if (!leaf->count || !(leaf->keys[leaf->count-1] < new_leaf->keys[0])) {
+					// another tail's keys are in the way, the leaf can't be
+					// linked in as is
+					node->writeUnlock();
+					if (parent)
+						parent->writeUnlock();
+					copy_leaf(new_leaf);
+					return;
+				}
 				if (parent)
 					parent->insert(leaf->keys[leaf->count-1], new_leaf);
 				else
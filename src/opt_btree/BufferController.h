@@ -0,0 +1,138 @@
+#pragma once
+#include<atomic>
+#include<mutex>
+#include<chrono>
+#include<algorithm>
+
+
+// which inserts RingBufferedBTree routes through its buffers
+enum class Admission {
+	// buffer every insert
+	All,
+	// buffer only keys at or above the start of the range that recently
+	// extended the tree's maximum, everything else goes to the tree
+	Tail
+};
+
+// runtime sizing of the insert buffers in RingBufferedBTree
+struct BufferConfig {
+	// slots used per buffer when the tree is created
+	long buffer_capacity = 1024;
+	// bounds for the adaptive controller, storage for max_buffer_capacity
+	// slots is allocated when a buffer is first needed
+	long min_buffer_capacity = 64;
+	long max_buffer_capacity = 1024;
+	// upper bound on the number of buffers in the ring, buffers are only
+	// allocated once every existing buffer is busy
+	int max_buffers = 32;
+	// let the controller resize buffers between rotations
+	bool adaptive = false;
+	Admission admission = Admission::Tail;
+	// average number of buffered slots a lookup may scan before the
+	// controller starts shrinking buffers
+	long scan_budget = 2048;
+	// a buffer that takes longer than this to fill holds entries out of the
+	// tree for too long, shrink it
+	long max_fill_ns = 10'000'000;
+	// bound on how long an entry may stay buffered, a background thread
+	// flushes partially filled buffers to keep it, 0 leaves entries
+	// buffered until their buffer fills or flush() is called
+	long max_staleness_ns = 0;
+
+	// copy with the bounds made consistent
+	BufferConfig checked() const {
+		BufferConfig c = *this;
+		// a rotation needs somewhere to go
+		c.max_buffers = std::max(c.max_buffers, 2);
+		c.max_buffer_capacity = std::max(c.max_buffer_capacity, 1L);
+		c.min_buffer_capacity = std::clamp(c.min_buffer_capacity, 1L, c.max_buffer_capacity);
+		c.buffer_capacity = std::clamp(c.buffer_capacity, c.min_buffer_capacity, c.max_buffer_capacity);
+		c.max_staleness_ns = std::max(c.max_staleness_ns, 0L);
+		return c;
+	}
+};
+
+
+static inline long now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Picks the capacity of the next activated buffer from what was observed
+// while the previous one filled and flushed. Runs on the flushing thread,
+// concurrent flushers simply skip the update.
+class BufferController {
+	public:
+		// what happened to one buffer generation
+		struct Observation {
+			long capacity;
+			// activation until the buffer was full
+			long fill_ns;
+			// time spent inserting the buffer into the tree
+			long flush_ns;
+			// inserters that found no usable buffer (failed shared lock or
+			// waited on a rotation) since the last observation
+			long stalls;
+			// lookups and buffered slots they scanned since the last observation
+			long lookups;
+			long scanned;
+			int num_buffers;
+		};
+
+		enum class Decision { Keep, Grow, Shrink, AddBuffer };
+
+	private:
+		const BufferConfig &config;
+		std::mutex mu;
+		std::atomic<long> capacity;
+		// smoothed signals, only touched while holding mu
+		double avg_stalls = 0, avg_scan = 0, avg_drain = 0;
+		static constexpr double alpha = .25;
+
+	public:
+		BufferController(const BufferConfig &config) :
+			config(config),
+			capacity(std::clamp(config.buffer_capacity, config.min_buffer_capacity, config.max_buffer_capacity)) {
+		}
+
+		long next_capacity() const {
+			return capacity.load(std::memory_order_relaxed);
+		}
+
+		Decision observe(const Observation &obs) {
+			if (!config.adaptive || !mu.try_lock())
+				return Decision::Keep;
+
+			avg_stalls += alpha * ((double)obs.stalls - avg_stalls);
+			if (obs.lookups)
+				avg_scan += alpha * ((double)obs.scanned / obs.lookups - avg_scan);
+			// > 1 when flushing a buffer takes longer than the rest of the
+			// ring takes to fill
+			double drain = (double)obs.flush_ns / std::max(1L, obs.fill_ns * std::max(1, obs.num_buffers - 1));
+			avg_drain += alpha * (drain - avg_drain);
+
+			Decision d = Decision::Keep;
+			long cap = capacity.load(std::memory_order_relaxed);
+			if (avg_scan > config.scan_budget || obs.fill_ns > config.max_fill_ns) {
+				// reads pay for every buffered slot, or entries sit in the
+				// buffer for too long
+				cap = std::max(config.min_buffer_capacity, cap / 2);
+				d = Decision::Shrink;
+			} else if (avg_drain > 1) {
+				// flushes can't keep up, more buffers let writers keep going
+				d = Decision::AddBuffer;
+			} else if (avg_stalls > 1) {
+				// writers keep hitting rotations, amortize them over more slots
+				cap = std::min(config.max_buffer_capacity, cap * 2);
+				d = Decision::Grow;
+			}
+			if (cap != capacity.load(std::memory_order_relaxed)) {
+				capacity.store(cap, std::memory_order_relaxed);
+				// start measuring the new size from scratch
+				avg_stalls = avg_scan = 0;
+			}
+			mu.unlock();
+			return d;
+		}
+};
@@ -0,0 +1,321 @@
+#pragma once
+#include "BTreeOLC.h"
+#include<type_traits>
+#include<limits>
+#include<cstdint>
+#include<cstring>
+#include<algorithm>
+#include<emmintrin.h>
+
+namespace btreeolc {
+
+// Leaf for integer keys that stores each key as a delta from the smallest
+// key in the leaf, in 16 or 32 bits when the leaf's key range allows it.
+// A run of consecutive keys stores no keys at all. The narrowest encoding
+// that fits is picked whenever the leaf is rebuilt, an insert that does not
+// fit the current one rebuilds the leaf in a wider encoding, or reports it
+// full through canInsert so the tree splits it first. Use it as the Leaf of
+// a BTree, BTree<long, long, CompressedLeaf<long, long>>.
+template<class Key,class Payload>
+struct CompressedLeaf : public BTreeLeafBase {
+   static_assert(std::is_integral_v<Key>, "CompressedLeaf needs integer keys");
+   using UKey = std::make_unsigned_t<Key>;
+
+   enum class Mode : uint8_t { Dense, Delta16, Delta32, Wide };
+
+   // read as one word so a reader racing a rebuild never mixes the mode of
+   // one layout with the capacity of another
+   struct Layout {
+      Mode mode;
+      uint16_t capacity;
+   };
+
+   Key base;
+   Layout layout;
+
+   static constexpr size_t headerSize = sizeof(BTreeLeafBase)+sizeof(Key)+sizeof(Layout);
+   static constexpr size_t dataSize = pageSize-((headerSize+7)&~size_t(7));
+   alignas(8) unsigned char data[dataSize];
+
+   static constexpr size_t width(Mode m) {
+      switch (m) {
+         case Mode::Dense: return 0;
+         case Mode::Delta16: return 2;
+         case Mode::Delta32: return 4;
+         default: return sizeof(Key);
+      }
+   }
+   static constexpr uint16_t capacity(Mode m) {
+      return std::min<size_t>((dataSize-(alignof(Payload)-1))/(width(m)+sizeof(Payload)), 0xffff);
+   }
+   static size_t payloadOffset(Layout l) {
+      const size_t end = width(l.mode)*l.capacity;
+      return (end+alignof(Payload)-1)&~(alignof(Payload)-1);
+   }
+   // the most entries any encoding holds
+   static constexpr uint64_t maxEntries = capacity(Mode::Dense);
+
+   CompressedLeaf() {
+      count=0;
+      type=typeMarker;
+      base=0;
+      layout={Mode::Dense, capacity(Mode::Dense)};
+   }
+
+   bool isFull() { return count==layout.capacity; };
+
+   template<class T>
+   T* array() { return reinterpret_cast<T*>(data); }
+   template<class T>
+   const T* array() const { return reinterpret_cast<const T*>(data); }
+   Payload* payloads(Layout l) { return reinterpret_cast<Payload*>(data+payloadOffset(l)); }
+
+   // indexes are clamped to the layout so that optimistic readers that see
+   // a torn count stay inside the page, the version check discards what
+   // they read
+   Key keyAt(unsigned i) const {
+      const Layout l = layout;
+      i = std::min<unsigned>(i, l.capacity-1);
+      switch (l.mode) {
+         case Mode::Dense: return base+Key(i);
+         case Mode::Delta16: return Key(UKey(base)+array<uint16_t>()[i]);
+         case Mode::Delta32: return Key(UKey(base)+array<uint32_t>()[i]);
+         default: return array<Key>()[i];
+      }
+   }
+
+   Payload& payloadAt(unsigned i) {
+      const Layout l = layout;
+      return payloads(l)[std::min<unsigned>(i, l.capacity-1)];
+   }
+
+   // first position in [lower, upper) whose delta is >= d, narrowed by
+   // binary search and finished with SSE2 compares. Deltas are unsigned,
+   // flipping the sign bit makes the signed compares order them.
+   static unsigned lowerBound16(const uint16_t* a, unsigned lower, unsigned upper, uint16_t d) {
+      while (upper-lower>32) {
+         const unsigned mid=((upper-lower)/2)+lower;
+         if (a[mid]<d) lower=mid+1; else upper=mid;
+      }
+      const __m128i bias=_mm_set1_epi16(int16_t(0x8000));
+      const __m128i t=_mm_xor_si128(_mm_set1_epi16(int16_t(d)), bias);
+      unsigned i=lower;
+      unsigned below=0;
+      for (; i+8<=upper; i+=8) {
+         const __m128i v=_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)), bias);
+         below+=__builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi16(v, t)))/2;
+      }
+      for (; i<upper; i++)
+         below+=a[i]<d;
+      return lower+below;
+   }
+
+   static unsigned lowerBound32(const uint32_t* a, unsigned lower, unsigned upper, uint32_t d) {
+      while (upper-lower>16) {
+         const unsigned mid=((upper-lower)/2)+lower;
+         if (a[mid]<d) lower=mid+1; else upper=mid;
+      }
+      const __m128i bias=_mm_set1_epi32(int32_t(0x80000000));
+      const __m128i t=_mm_xor_si128(_mm_set1_epi32(int32_t(d)), bias);
+      unsigned i=lower;
+      unsigned below=0;
+      for (; i+4<=upper; i+=4) {
+         const __m128i v=_mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a+i)), bias);
+         below+=__builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi32(v, t)))/4;
+      }
+      for (; i<upper; i++)
+         below+=a[i]<d;
+      return lower+below;
+   }
+
+   unsigned lowerBound(Key k) const {
+      const Layout l = layout;
+      const unsigned n = std::min<unsigned>(count, l.capacity);
+      if (l.mode==Mode::Wide) {
+         const Key* keys=array<Key>();
+         unsigned lower=0;
+         unsigned upper=n;
+         while (lower<upper) {
+            const unsigned mid=((upper-lower)/2)+lower;
+            if (keys[mid]<k) lower=mid+1; else upper=mid;
+         }
+         return lower;
+      }
+      if (!n || k<base)
+         return 0;
+      const UKey d=UKey(k)-UKey(base);
+      switch (l.mode) {
+         case Mode::Dense:
+            return d<n ? unsigned(d) : n;
+         case Mode::Delta16:
+            return d>0xffff ? n : lowerBound16(array<uint16_t>(), 0, n, uint16_t(d));
+         default:
+            return d>0xffffffff ? n : lowerBound32(array<uint32_t>(), 0, n, uint32_t(d));
+      }
+   }
+
+   // narrowest encoding for n sorted keys from lo to hi
+   static Mode modeFor(Key lo, Key hi, unsigned n) {
+      const UKey span=UKey(hi)-UKey(lo);
+      if (span==UKey(n-1))
+         return Mode::Dense;
+      if (span<=0xffff)
+         return Mode::Delta16;
+      if (sizeof(Key)>4 && span<=0xffffffff)
+         return Mode::Delta32;
+      return Mode::Wide;
+   }
+
+   // whether k can be inserted without splitting the leaf
+   bool canInsert(Key k) const {
+      const unsigned pos=lowerBound(k);
+      if (pos<count && keyAt(pos)==k)
+         return true;
+      if (!count)
+         return true;
+      const Key lo=std::min(keyAt(0), k);
+      const Key hi=std::max(keyAt(count-1), k);
+      return count+1u<=capacity(modeFor(lo, hi, count+1));
+   }
+
+   // re-encode n sorted entries in the narrowest encoding
+   void rebuild(const Key* keys, const Payload* ps, unsigned n) {
+      const Mode m = n ? modeFor(keys[0], keys[n-1], n) : Mode::Dense;
+      assert(n<=capacity(m));
+      const Layout l{m, capacity(m)};
+      layout=l;
+      base=n ? keys[0] : 0;
+      for (unsigned i=0; i<n; i++) {
+         switch (m) {
+            case Mode::Dense: break;
+            case Mode::Delta16: array<uint16_t>()[i]=uint16_t(UKey(keys[i])-UKey(base)); break;
+            case Mode::Delta32: array<uint32_t>()[i]=uint32_t(UKey(keys[i])-UKey(base)); break;
+            default: array<Key>()[i]=keys[i];
+         }
+      }
+      std::copy(ps, ps+n, payloads(l));
+      count=n;
+   }
+
+   // entries in key order with k inserted at pos, n is the result's size
+   unsigned gather(Key* keys, Payload* ps, unsigned pos, Key k, const Payload& p) {
+      unsigned n=0;
+      for (unsigned i=0; i<count; i++) {
+         if (i==pos) {
+            keys[n]=k;
+            ps[n++]=p;
+         }
+         keys[n]=keyAt(i);
+         ps[n++]=payloadAt(i);
+      }
+      if (pos==count) {
+         keys[n]=k;
+         ps[n++]=p;
+      }
+      return n;
+   }
+
+   template<class T>
+   void shiftUp(T* a, unsigned pos) {
+      memmove(a+pos+1, a+pos, sizeof(T)*(count-pos));
+   }
+
+   void insert(Key k,Payload p) {
+    unsigned pos=lowerBound(k);
+    if ((pos<count) && (keyAt(pos)==k)) {
+	// Upsert
+	if constexpr (is_versioned<Payload>::value) {
+		payloadAt(pos).set(p);
+	} else {
+		payloadAt(pos) = p;
+	}
+	return;
+    }
+    const Layout l=layout;
+    Payload* ps=payloads(l);
+    // deltas stay put unless k becomes the new smallest key
+    if (count && !(l.mode!=Mode::Wide && k<base) &&
+        modeFor(std::min(keyAt(0), k), std::max(keyAt(count-1), k), count+1)==l.mode) {
+      assert(count<l.capacity);
+      switch (l.mode) {
+         case Mode::Dense:
+            // a run only grows at its end here
+            break;
+         case Mode::Delta16:
+            shiftUp(array<uint16_t>(), pos);
+            array<uint16_t>()[pos]=uint16_t(UKey(k)-UKey(base));
+            break;
+         case Mode::Delta32:
+            shiftUp(array<uint32_t>(), pos);
+            array<uint32_t>()[pos]=uint32_t(UKey(k)-UKey(base));
+            break;
+         default:
+            shiftUp(array<Key>(), pos);
+            array<Key>()[pos]=k;
+      }
+      shiftUp(ps, pos);
+      ps[pos]=p;
+      count++;
+      return;
+    }
+    Key keys[maxEntries];
+    Payload tmp[maxEntries];
+    const unsigned n=gather(keys, tmp, pos, k, p);
+    rebuild(keys, tmp, n);
+   }
+
+   CompressedLeaf* split(Key& sep) {
+      Key keys[maxEntries];
+      Payload tmp[maxEntries];
+      unsigned n=0;
+      for (unsigned i=0; i<count; i++) {
+         keys[n]=keyAt(i);
+         tmp[n++]=payloadAt(i);
+      }
+      CompressedLeaf* newLeaf=new CompressedLeaf();
+      const unsigned left=n/2;
+      newLeaf->rebuild(keys+left, tmp+left, n-left);
+      rebuild(keys, tmp, left);
+      sep=keys[left-1];
+      return newLeaf;
+   }
+
+   void erase(unsigned pos) {
+      const Layout l=layout;
+      if (l.mode==Mode::Dense && pos!=0 && pos!=count-1u) {
+         // a hole ends the run
+         Key keys[maxEntries];
+         Payload tmp[maxEntries];
+         unsigned n=0;
+         for (unsigned i=0; i<count; i++) {
+            if (i==pos)
+               continue;
+            keys[n]=keyAt(i);
+            tmp[n++]=payloadAt(i);
+         }
+         rebuild(keys, tmp, n);
+         return;
+      }
+      Payload* ps=payloads(l);
+      switch (l.mode) {
+         case Mode::Dense:
+            if (pos==0)
+               base++;
+            break;
+         case Mode::Delta16:
+            memmove(array<uint16_t>()+pos, array<uint16_t>()+pos+1, sizeof(uint16_t)*(count-pos-1));
+            break;
+         case Mode::Delta32:
+            memmove(array<uint32_t>()+pos, array<uint32_t>()+pos+1, sizeof(uint32_t)*(count-pos-1));
+            break;
+         default:
+            memmove(array<Key>()+pos, array<Key>()+pos+1, sizeof(Key)*(count-pos-1));
+      }
+      memmove(ps+pos, ps+pos+1, sizeof(Payload)*(count-pos-1));
+      count--;
+   }
+};
+
+static_assert(sizeof(CompressedLeaf<long,long>)<=pageSize);
+
+}
@@ -0,0 +1,405 @@
+#pragma once
+#include "BTreeOLC.h"
+#include<numeric>
+
+namespace btreeolc {
+
+// CountedInner's entries, its counts and the adding counter fit a page
+template<class Key>
+constexpr uint64_t countedInnerEntries=(pageSize-sizeof(NodeBase)-sizeof(uint64_t))/(sizeof(Key)+sizeof(NodeBase*)+sizeof(uint64_t));
+
+// Inner node that also knows how many entries sit below each child.
+template<class Key>
+struct CountedInner : public BTreeInner<Key,countedInnerEntries<Key>> {
+   using Inner = BTreeInner<Key,countedInnerEntries<Key>>;
+   uint64_t counts[Inner::maxEntries];
+   // inserts and removes in the middle of adding to the counts below
+   // this node, it splits only once they are done
+   std::atomic<uint64_t> adding{0};
+
+   uint64_t total() {
+      return std::accumulate(counts, counts+this->count+1, uint64_t(0));
+   }
+
+   // joins the adding if the node is still at version
+   bool enterAdding(uint64_t version) {
+      adding.fetch_add(1);
+      bool needRestart=false;
+      this->checkOrRestart(version, needRestart);
+      if (needRestart)
+         adding.fetch_sub(1);
+      return !needRestart;
+   }
+
+   void leaveAdding() {
+      adding.fetch_sub(1);
+   }
+
+   // with the node write locked no one joins, wait for the others
+   void waitAdding() {
+      while (adding.load())
+         _mm_pause();
+   }
+
+   void add(unsigned pos,int64_t delta) {
+      std::atomic_ref<uint64_t>(counts[pos]).fetch_add(delta);
+   }
+
+   CountedInner* split(Key& sep) {
+      CountedInner* newInner=new CountedInner();
+      newInner->count=this->count-(this->count/2);
+      this->count=this->count-newInner->count-1;
+      sep=this->keys[this->count];
+      memcpy(newInner->keys,this->keys+this->count+1,sizeof(Key)*(newInner->count+1));
+      memcpy(newInner->children,this->children+this->count+1,sizeof(NodeBase*)*(newInner->count+1));
+      memcpy(newInner->counts,counts+this->count+1,sizeof(uint64_t)*(newInner->count+1));
+      return newInner;
+   }
+
+   // child goes right of k, the child left of it now holds leftCount
+   // entries and the new one childCount
+   void insert(Key k,NodeBase* child,uint64_t leftCount,uint64_t childCount) {
+      unsigned pos=this->lowerBound(k);
+      Inner::insert(k, child);
+      memmove(counts+pos+1,counts+pos,sizeof(uint64_t)*(this->count-pos));
+      counts[pos]=leftCount;
+      counts[pos+1]=childCount;
+   }
+};
+
+static_assert(sizeof(CountedInner<long>) <= pageSize);
+
+
+// BTree that keeps per-child entry counts in its inner nodes, for rank,
+// select and counting a key range in O(log n). Readers stay optimistic.
+// Writers lock the leaf and split like BTree::insert. Inserts of new keys
+// and removes then add to a count on every level with atomic adds, while
+// they are at it the nodes on their path cannot split. Readers may see
+// an add on one level and not yet on another.
+template<class Key,class Value>
+struct CountedBTree : public BTree<Key,Value,BTreeLeaf<Key,Value>,CountedInner<Key>> {
+  using Leaf = BTreeLeaf<Key,Value>;
+  using Inner = CountedInner<Key>;
+  static const int maxDepth=32;
+
+  // inner nodes read on the way down with the version seen and the child
+  // taken
+  struct Path {
+    Inner* nodes[maxDepth];
+    uint64_t versions[maxDepth];
+    unsigned pos[maxDepth];
+    int depth=0;
+
+    // join the adding of every node as it was read, false if any changed
+    bool enter() {
+      for (int i=0; i<depth; i++) {
+	if (!nodes[i]->enterAdding(versions[i])) {
+	  leave(i);
+	  return false;
+	}
+      }
+      return true;
+    }
+    void leave(int n) {
+      for (int i=0; i<n; i++)
+	nodes[i]->leaveAdding();
+    }
+    void add(int64_t delta) {
+      for (int i=0; i<depth; i++)
+	nodes[i]->add(pos[i], delta);
+    }
+  };
+
+  void makeRoot(Key k,NodeBase* leftChild,NodeBase* rightChild,uint64_t leftCount,uint64_t rightCount) {
+    auto inner = new Inner();
+    inner->count = 1;
+    inner->keys[0] = k;
+    inner->children[0] = leftChild;
+    inner->children[1] = rightChild;
+    inner->counts[0] = leftCount;
+    inner->counts[1] = rightCount;
+    this->root = inner;
+  }
+
+  static uint64_t size(NodeBase* node) {
+    if (node->type==PageType::BTreeInner)
+      return static_cast<Inner*>(node)->total();
+    return node->count;
+  }
+
+  // Descends to k's leaf like BTree::insert, splitting full nodes on the
+  // way when split is set. Returns the leaf read locked at versionNode,
+  // nullptr to restart.
+  Leaf* descend(Key k, Path& path, uint64_t& versionNode, bool split) {
+    bool needRestart = false;
+    path.depth = 0;
+
+    NodeBase* node = this->root;
+    versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart || (node!=this->root)) return nullptr;
+
+    // Parent of current node
+    Inner* parent = nullptr;
+    uint64_t versionParent;
+
+    while (node->type==PageType::BTreeInner) {
+      auto inner = static_cast<Inner*>(node);
+
+      // Split eagerly if full
+      if (split && inner->isFull()) {
+	// Lock
+	if (parent) {
+	  parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+	  if (needRestart) return nullptr;
+	}
+	node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+	if (needRestart) {
+	  if (parent)
+	    parent->writeUnlock();
+	  return nullptr;
+	}
+	if (!parent && (node != this->root)) { // there's a new parent
+	  node->writeUnlock();
+	  return nullptr;
+	}
+	if (parent)
+	  parent->waitAdding();
+	inner->waitAdding();
+	// Split
+	Key sep; Inner* newInner = inner->split(sep);
+	if (parent)
+	  parent->insert(sep,newInner,inner->total(),newInner->total());
+	else
+	  makeRoot(sep,inner,newInner,inner->total(),newInner->total());
+	// Unlock and restart
+	node->writeUnlock();
+	if (parent)
+	  parent->writeUnlock();
+	return nullptr;
+      }
+
+      if (parent) {
+	parent->readUnlockOrRestart(versionParent, needRestart);
+	if (needRestart) return nullptr;
+      }
+
+      parent = inner;
+      versionParent = versionNode;
+
+      unsigned pos = inner->lowerBound(k);
+      if (path.depth==maxDepth) return nullptr;
+      path.nodes[path.depth] = inner;
+      path.versions[path.depth] = versionNode;
+      path.pos[path.depth++] = pos;
+
+      node = inner->children[pos];
+      inner->checkOrRestart(versionNode, needRestart);
+      if (needRestart) return nullptr;
+      versionNode = node->readLockOrRestart(needRestart);
+      if (needRestart) return nullptr;
+    }
+
+    auto leaf = static_cast<Leaf*>(node);
+    if (split && !leaf->canInsert(k)) {
+      // Lock
+      if (parent) {
+	parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+	if (needRestart) return nullptr;
+      }
+      node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+      if (needRestart) {
+	if (parent) parent->writeUnlock();
+	return nullptr;
+      }
+      if (!parent && (node != this->root)) { // there's a new parent
+	node->writeUnlock();
+	return nullptr;
+      }
+      if (parent)
+	parent->waitAdding();
+      // Split
+      Key sep; Leaf* newLeaf = leaf->split(sep);
+      if (parent)
+	parent->insert(sep, newLeaf, leaf->count, newLeaf->count);
+      else
+	makeRoot(sep, leaf, newLeaf, leaf->count, newLeaf->count);
+      // Unlock and restart
+      node->writeUnlock();
+      if (parent)
+	parent->writeUnlock();
+      return nullptr;
+    }
+    return leaf;
+  }
+
+  void insert(Key k, Value v) {
+    int restartCount = 0;
+  restart:
+    if (restartCount++)
+      this->yield(restartCount);
+    bool needRestart = false;
+
+    Path path;
+    uint64_t versionNode;
+    Leaf* leaf = descend(k, path, versionNode, true);
+    if (!leaf) goto restart;
+
+    unsigned pos = leaf->lowerBound(k);
+    const bool exists = (pos<leaf->count) && (leaf->keys[pos]==k);
+    leaf->upgradeToWriteLockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    if (exists) {
+      // only the leaf changes, its parent still has to be the one read
+      if (path.depth) {
+	path.nodes[path.depth-1]->readUnlockOrRestart(path.versions[path.depth-1], needRestart);
+	if (needRestart) {
+	  leaf->writeUnlock();
+	  goto restart;
+	}
+      }
+    } else if (!path.enter()) {
+      leaf->writeUnlock();
+      goto restart;
+    }
+    leaf->insert(k, v);
+    if (!exists) {
+      path.add(1);
+      path.leave(path.depth);
+    }
+    leaf->writeUnlock();
+  }
+
+  // Removes k if pred(payload) holds, returns whether it did.
+  template<class Pred>
+  bool remove_if(Key k, Pred pred) {
+    int restartCount = 0;
+  restart:
+    if (restartCount++)
+      this->yield(restartCount);
+    bool needRestart = false;
+
+    Path path;
+    uint64_t versionNode;
+    Leaf* leaf = descend(k, path, versionNode, false);
+    if (!leaf) goto restart;
+
+    leaf->upgradeToWriteLockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    unsigned pos = leaf->lowerBound(k);
+    if ((pos>=leaf->count) || (leaf->keys[pos]!=k) || !pred(leaf->payloads[pos])) {
+      leaf->writeUnlock();
+      return false;
+    }
+    if (!path.enter()) {
+      leaf->writeUnlock();
+      goto restart;
+    }
+    leaf->erase(pos);
+    path.add(-1);
+    path.leave(path.depth);
+    leaf->writeUnlock();
+    return true;
+  }
+
+  // number of entries with keys < k, or <= k if inclusive
+  uint64_t rank(Key k, bool inclusive = false) {
+    int restartCount = 0;
+  restart:
+    if (restartCount++)
+      this->yield(restartCount);
+    bool needRestart = false;
+    uint64_t below = 0;
+
+    NodeBase* node = this->root;
+    uint64_t versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart || (node!=this->root)) goto restart;
+
+    while (node->type==PageType::BTreeInner) {
+      auto inner = static_cast<Inner*>(node);
+      unsigned pos = inner->lowerBound(k);
+      for (unsigned i=0; i<pos; i++)
+	below += inner->counts[i];
+      node = inner->children[pos];
+      inner->checkOrRestart(versionNode, needRestart);
+      if (needRestart) goto restart;
+      versionNode = node->readLockOrRestart(needRestart);
+      if (needRestart) goto restart;
+    }
+
+    auto leaf = static_cast<Leaf*>(node);
+    // an empty leaf's lowerBound reads a stale key and may return 1
+    unsigned pos = std::min<unsigned>(leaf->lowerBound(k), leaf->count);
+    if (inclusive && (pos<leaf->count) && (leaf->keys[pos]==k))
+      pos++;
+    below += pos;
+    node->readUnlockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    return below;
+  }
+
+  // number of entries with lo <= key <= hi, the two ends are read
+  // separately and only agree if no writer got in between
+  uint64_t count_range(Key lo, Key hi) {
+    if (hi < lo)
+      return 0;
+    const uint64_t end = rank(hi, true);
+    const uint64_t begin = rank(lo);
+    return end > begin ? end - begin : 0;
+  }
+
+  // entry with rank i, counting from the smallest key, false if there
+  // are no more than i entries
+  bool select(uint64_t i, Key& key, Value& result) {
+    int restartCount = 0;
+  restart:
+    if (restartCount++)
+      this->yield(restartCount);
+    bool needRestart = false;
+    uint64_t left = i;
+
+    NodeBase* node = this->root;
+    uint64_t versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart || (node!=this->root)) goto restart;
+
+    while (node->type==PageType::BTreeInner) {
+      auto inner = static_cast<Inner*>(node);
+      unsigned pos = 0;
+      while (pos<inner->count && left>=inner->counts[pos])
+	left -= inner->counts[pos++];
+      node = inner->children[pos];
+      inner->checkOrRestart(versionNode, needRestart);
+      if (needRestart) goto restart;
+      versionNode = node->readLockOrRestart(needRestart);
+      if (needRestart) goto restart;
+    }
+
+    auto leaf = static_cast<Leaf*>(node);
+    bool found = left<leaf->count;
+    if (found) {
+      key = leaf->keys[left];
+      result = leaf->payloads[left];
+    }
+    node->readUnlockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    return found;
+  }
+
+  // number of entries in the tree
+  uint64_t size() {
+    int restartCount = 0;
+  restart:
+    if (restartCount++)
+      this->yield(restartCount);
+    bool needRestart = false;
+
+    NodeBase* node = this->root;
+    uint64_t versionNode = node->readLockOrRestart(needRestart);
+    if (needRestart || (node!=this->root)) goto restart;
+    const uint64_t n = size(node);
+    node->readUnlockOrRestart(versionNode, needRestart);
+    if (needRestart) goto restart;
+    return n;
+  }
+};
+
+}
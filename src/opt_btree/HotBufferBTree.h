@@ -0,0 +1,766 @@
+#pragma once
+#include "BTreeOLC.h"
+#include "BufferController.h"
+#include "MergedScan.h"
+#include "TombstoneLog.h"
+#include<atomic>
+#include<memory>
+#include<array>
+#include<mutex>
+#include<thread>
+#include<chrono>
+#include<limits>
+#include<utility>
+#include<algorithm>
+#include<stop_token>
+#include<condition_variable>
+
+using namespace btreeolc;
+
+
+struct HotBufferConfig {
+	// number of key ranges that can have a delta buffer at once, at most 64
+	int max_deltas = 16;
+	long delta_capacity = 512;
+	// restarts on a leaf within one window that make it hot, a failed lock
+	// upgrade or the leaf found locked
+	int hot_restarts = 16;
+	long window_ns = 1L << 20;
+	// a delta generation still open after this long is folded back and the
+	// delta detached, as is one that took longer to fill, 0 keeps deltas
+	// attached until quiesce()
+	long cool_fill_ns = 5'000'000;
+
+	// copy with the bounds made consistent
+	HotBufferConfig checked() const {
+		HotBufferConfig c = *this;
+		c.max_deltas = std::clamp(c.max_deltas, 1, 64);
+		c.delta_capacity = std::clamp(c.delta_capacity, 1L, 1L << 30);
+		c.hot_restarts = std::max(c.hot_restarts, 1);
+		c.window_ns = std::max(c.window_ns, 1L);
+		c.cool_fill_ns = std::max(c.cool_fill_ns, 0L);
+		return c;
+	}
+};
+
+
+// B-tree that detects contended leaves from OLC restarts and gives their key
+// range a delta buffer. Writers append to the delta without taking the leaf
+// lock, readers merge the delta with the tree by version, and a full delta is
+// folded back into the tree, by its last writer with help from the writers
+// waiting on it. A delta that stays partly filled is folded and detached by a
+// background thread once it is older than cool_fill_ns. The rightmost leaf
+// under a sequential workload is just one such range.
+template<class K, class V>
+class HotBufferedBTree : public BTree<K, Versioned<V>> {
+	using Tree = BTree<K, Versioned<V>>;
+
+	// key range (lo, hi] of a node, open on a side that has no fence
+	struct Range {
+		K lo {}, hi {};
+		bool has_lo = false, has_hi = false;
+
+		bool contains(const K k) const {
+			return (!has_lo || k > lo) && (!has_hi || k <= hi);
+		}
+		bool overlaps(const Range &o) const {
+			return (!has_lo || !o.has_hi || o.hi > lo) && (!o.has_lo || !has_hi || hi > o.lo);
+		}
+	};
+
+	struct Slot {
+		// version of the entry, 0 while the slot is written and published
+		// last, a slot belongs to the current generation once its stamp is
+		// above base
+		std::atomic<long> stamp;
+		std::atomic<K> key;
+		std::atomic<V> val;
+		std::atomic<bool> tombstone;
+		// dead slots are reserved by a writer that lost a race with a
+		// reattach, they are published but never read
+		std::atomic<bool> live;
+
+		void write(const K k, const V v, const bool tomb, const bool is_live, const long ver) {
+			stamp.store(0, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			key.store(k, std::memory_order_relaxed);
+			val.store(v, std::memory_order_relaxed);
+			tombstone.store(tomb, std::memory_order_relaxed);
+			live.store(is_live, std::memory_order_relaxed);
+			stamp.store(ver, std::memory_order_release);
+		}
+
+		// copy of a published live entry above base, false if there is none
+		// or the slot was rewritten while reading it
+		bool read(const long base, K &k, Versioned<V> &out) const {
+			const long v = stamp.load(std::memory_order_acquire);
+			if (v <= base)
+				return false;
+			k = key.load(std::memory_order_relaxed);
+			out.val = val.load(std::memory_order_relaxed);
+			out.tombstone = tombstone.load(std::memory_order_relaxed);
+			const bool is_live = live.load(std::memory_order_relaxed);
+			out.version = v;
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return is_live && stamp.load(std::memory_order_relaxed) == v;
+		}
+	};
+
+	// Writers reserve a slot with a single fetch_add on ticket, which holds the
+	// generation in the high half and the next slot in the low half. The
+	// generation changes whenever the delta is reopened or detached, so a
+	// writer can tell whether the range it checked still applies. The range is
+	// only rewritten while the delta is detached and its base is DETACHED,
+	// readers find nothing in it then however they read it.
+	struct Delta {
+		static constexpr uint64_t CLOSED = 1UL << 31;
+		// base of a detached delta, no stamp is above it
+		static constexpr long DETACHED = std::numeric_limits<long>::max();
+
+		std::atomic<uint64_t> ticket;
+		std::atomic<K> lo, hi;
+		std::atomic<bool> has_lo, has_hi;
+		std::atomic<long> base;
+		std::atomic<long> attached_ns;
+		const long capacity;
+		std::unique_ptr<Slot[]> slots;
+
+		// While a closed generation is folded, its slots [0, fold_end) split
+		// into chunks any thread can claim. work holds the fold's epoch in the
+		// high half, then the number of chunks and the next unclaimed one in
+		// 16 bits each.
+		long fold_end;
+		long chunk_size;
+		std::atomic<uint64_t> work;
+		std::atomic<long> chunks_done;
+
+		Delta(const long capacity) : ticket(CLOSED), lo(), hi(), has_lo(false), has_hi(false),
+			base(DETACHED), attached_ns(0), capacity(capacity), slots(new Slot[capacity]()),
+			fold_end(0), chunk_size(1), work(0), chunks_done(0) {
+		}
+
+		static uint32_t gen(const uint64_t t) {
+			return t >> 32;
+		}
+		static long pos(const uint64_t t) {
+			return t & 0xffffffff;
+		}
+
+		Range range() const {
+			Range r;
+			r.lo = lo.load(std::memory_order_relaxed);
+			r.hi = hi.load(std::memory_order_relaxed);
+			r.has_lo = has_lo.load(std::memory_order_relaxed);
+			r.has_hi = has_hi.load(std::memory_order_relaxed);
+			return r;
+		}
+
+		// only while detached
+		void set_range(const Range &r) {
+			lo.store(r.lo, std::memory_order_relaxed);
+			hi.store(r.hi, std::memory_order_relaxed);
+			has_lo.store(r.has_lo, std::memory_order_relaxed);
+			has_hi.store(r.has_hi, std::memory_order_relaxed);
+		}
+
+		// open a new generation, versions (base, base + capacity]
+		void open(const long new_base) {
+			base.store(new_base, std::memory_order_relaxed);
+			attached_ns.store(now_ns(), std::memory_order_relaxed);
+			uint64_t t = ticket.load(std::memory_order_relaxed);
+			ticket.store((uint64_t)(gen(t) + 1) << 32, std::memory_order_release);
+		}
+
+		// after the last fold, the slots still hold its entries
+		void detach() {
+			base.store(DETACHED, std::memory_order_relaxed);
+			uint64_t t = ticket.load(std::memory_order_relaxed);
+			ticket.store(((uint64_t)(gen(t) + 1) << 32) | CLOSED, std::memory_order_release);
+		}
+
+		bool search(K key, Versioned<V> &result) const {
+			const uint64_t t = ticket.load(std::memory_order_acquire);
+			if (!range().contains(key))
+				return false;
+			const long b = base.load(std::memory_order_relaxed);
+			const long end = std::min(pos(t), capacity);
+
+			bool found = false;
+			Versioned<V> r, e;
+			r.version = -1;
+			for (long i = 0; i < end; ++i) {
+				K k;
+				if (slots[i].read(b, k, e) && k == key) {
+					r.set(e);
+					found = true;
+				}
+			}
+			// a new generation only starts after this one was folded, the
+			// tree has the entries in that case
+			if (!found || gen(ticket.load(std::memory_order_acquire)) != gen(t))
+				return false;
+			result.set(r);
+			return true;
+		}
+
+		// add the live entries with keys >= key, nothing if the delta was
+		// folded meanwhile
+		void collect(K key, MergedScan<K,Versioned<V>> &merged) const {
+			const uint64_t t = ticket.load(std::memory_order_acquire);
+			const Range r = range();
+			if (r.has_hi && r.hi < key)
+				return;
+			const long b = base.load(std::memory_order_relaxed);
+			const long end = std::min(pos(t), capacity);
+			const size_t m = merged.mark();
+			Versioned<V> e;
+			for (long i = 0; i < end; ++i) {
+				K k;
+				if (slots[i].read(b, k, e) && k >= key)
+					merged.add(k, e);
+			}
+			if (gen(ticket.load(std::memory_order_acquire)) != gen(t))
+				merged.rollback(m);
+		}
+
+		// split the slots of a closed generation into chunks and open them
+		// for claiming
+		void plan(const long end, const long min_chunk) {
+			fold_end = end;
+			chunk_size = std::max(min_chunk, end / 0xffff + 1);
+			const uint64_t chunks = (end + chunk_size - 1) / chunk_size;
+			chunks_done.store(0, std::memory_order_relaxed);
+			const uint64_t epoch = (work.load(std::memory_order_relaxed) >> 32) + 1;
+			work.store((epoch << 32) | (chunks << 16), std::memory_order_release);
+		}
+
+		static long chunks(const uint64_t w) {
+			return (w >> 16) & 0xffff;
+		}
+
+		// claim the next chunk of the current fold, -1 if none is left
+		long claim() {
+			uint64_t w = work.load(std::memory_order_acquire);
+			while ((long)(w & 0xffff) < chunks(w)) {
+				if (work.compare_exchange_weak(w, w + 1, std::memory_order_acquire))
+					return w & 0xffff;
+			}
+			return -1;
+		}
+
+		// slots covered by chunk c
+		std::pair<long,long> chunk(const long c) const {
+			return {c * chunk_size, std::min(fold_end, (c + 1) * chunk_size)};
+		}
+	};
+
+	const HotBufferConfig config;
+	std::unique_ptr<std::unique_ptr<Delta>[]> deltas;
+	// deltas that are attached to a range, including ones being folded
+	std::atomic<uint64_t> attached;
+	std::mutex attach_mu;
+
+	// Start of the next block of versions handed to a delta. Direct inserts
+	// read it before looking for a delta covering their key and are stamped
+	// with it: that is above every delta entry written so far, and below every
+	// entry of a delta attached later, which can only cover the key if the
+	// insert would have seen it.
+	std::atomic<long> next_version;
+	// tombstones in the tree waiting to be removed
+	TombstoneLog<K> tombstones;
+
+	// restarts on leaves, hashed by leaf, (window << 16) | count
+	static constexpr int heat_slots = 1024;
+	std::array<std::atomic<uint64_t>, heat_slots> heat;
+
+	// slots per claimable chunk of a fold
+	static constexpr long fold_chunk = 64;
+
+	// folds and detaches deltas left open longer than config.cool_fill_ns,
+	// only started if that is set
+	std::condition_variable_any cool_cv;
+	std::mutex cool_mu;
+	std::jthread cooler;
+
+	// hand out the next block of versions, caller holds attach_mu
+	long next_block() {
+		return next_version.fetch_add(config.delta_capacity + 1);
+	}
+
+	// called after a restart on the leaf covering range, returns true if the
+	// range got a delta
+	bool note_contention(NodeBase *leaf, const Range &range) {
+		const uint64_t window = now_ns() / config.window_ns;
+		auto &h = heat[(reinterpret_cast<uintptr_t>(leaf) >> 12) % heat_slots];
+		uint64_t curr = h.load(std::memory_order_relaxed), next;
+		do {
+			next = ((curr >> 16) == (window & 0xffffffffffff)) ? curr + 1 : ((window << 16) | 1);
+		} while (!h.compare_exchange_weak(curr, next, std::memory_order_relaxed));
+
+		if ((int)(next & 0xffff) < config.hot_restarts)
+			return false;
+		h.store(0, std::memory_order_relaxed);
+		return attach(range);
+	}
+
+	// called when node was found locked, a leaf held by another writer is
+	// contention as much as a failed upgrade on it, and far more common
+	bool held(NodeBase *node, const Range &range) {
+		return node->type == PageType::BTreeLeaf && note_contention(node, range);
+	}
+
+	bool attach(const Range &range) {
+		std::lock_guard<std::mutex> lk(attach_mu);
+		const uint64_t a = attached.load(std::memory_order_relaxed);
+		int free_slot = -1;
+		for (int i = 0; i < config.max_deltas; ++i) {
+			if (!(a & (1ULL << i))) {
+				if (free_slot < 0)
+					free_slot = i;
+			} else if (deltas[i]->range().overlaps(range)) {
+				// already buffered
+				return true;
+			}
+		}
+		if (free_slot < 0)
+			return false;
+
+		if (!deltas[free_slot])
+			deltas[free_slot].reset(new Delta(config.delta_capacity));
+		Delta &d = *deltas[free_slot];
+		d.set_range(range);
+		// publish the still closed delta before taking versions, writers of
+		// the range wait for it from here on
+		attached.fetch_or(1ULL << free_slot);
+		d.open(next_block());
+		return true;
+	}
+
+	// insert the slots of chunk c into the tree, waiting for each to be
+	// published, the fold's entries keep their versions so chunks can go in
+	// any order
+	void apply_chunk(Delta &d, const long c) {
+		const auto [from, to] = d.chunk(c);
+		const long b = d.base.load(std::memory_order_relaxed);
+		for (long i = from; i < to; ++i) {
+			auto &s = d.slots[i];
+			long stamp;
+			while ((stamp = s.stamp.load(std::memory_order_acquire)) <= b)
+				_mm_pause();
+			// nobody writes the slot again before the next generation
+			if (s.live.load(std::memory_order_relaxed)) {
+				const K key = s.key.load(std::memory_order_relaxed);
+				const bool tombstone = s.tombstone.load(std::memory_order_relaxed);
+				Tree::insert(key, Versioned<V>(s.val.load(std::memory_order_relaxed), stamp, tombstone));
+				if (tombstone)
+					tombstones.add(key, stamp);
+			}
+		}
+	}
+
+	// apply a chunk of d's fold, false if there was nothing to claim
+	bool help(Delta &d) {
+		const long c = d.claim();
+		if (c < 0)
+			return false;
+		apply_chunk(d, c);
+		d.chunks_done.fetch_add(1, std::memory_order_release);
+		return true;
+	}
+
+	// Insert the first end slots of a closed generation into the tree, with
+	// help from writers waiting on the delta, then reopen the delta or
+	// detach it if the generation filled slowly or detach is set.
+	void fold(Delta &d, const int idx, const long end, const bool detach) {
+		const long fill_ns = now_ns() - d.attached_ns.load(std::memory_order_relaxed);
+		d.plan(end, fold_chunk);
+		for (long c; (c = d.claim()) >= 0;) {
+			apply_chunk(d, c);
+			d.chunks_done.fetch_add(1, std::memory_order_relaxed);
+		}
+		const long chunks = Delta::chunks(d.work.load(std::memory_order_relaxed));
+		while (d.chunks_done.load(std::memory_order_acquire) < chunks)
+			_mm_pause();
+
+		{
+			std::lock_guard<std::mutex> lk(attach_mu);
+			if (detach || (config.cool_fill_ns && fill_ns > config.cool_fill_ns)) {
+				// contention faded, the range goes back to plain tree inserts
+				d.detach();
+				attached.fetch_and(~(1ULL << idx));
+			} else {
+				d.open(next_block());
+			}
+		}
+		compact();
+	}
+
+	// Fold generation g of delta idx right away if it is still open, or help
+	// the fold that closed it and wait for it to finish.
+	void fold_gen(const int idx, const uint32_t g, const bool detach) {
+		Delta &d = *deltas[idx];
+		uint64_t t = d.ticket.load();
+		while (Delta::gen(t) == g && Delta::pos(t) < d.capacity) {
+			if (d.ticket.compare_exchange_weak(t, ((uint64_t)g << 32) | Delta::CLOSED)) {
+				fold(d, idx, Delta::pos(t), detach);
+				return;
+			}
+		}
+		while (Delta::gen(d.ticket.load()) == g && d.base.load() != Delta::DETACHED) {
+			if (!help(d))
+				std::this_thread::yield();
+		}
+	}
+
+	void fold_cool(std::stop_token stop) {
+		const auto period = std::chrono::nanoseconds(std::max(config.cool_fill_ns / 2, 1L));
+		std::unique_lock<std::mutex> lk(cool_mu);
+		while (!cool_cv.wait_for(lk, stop, period, [] { return false; })) {
+			if (stop.stop_requested())
+				break;
+			uint64_t a = attached.load();
+			while (a) {
+				const int idx = __builtin_ctzll(a);
+				a &= a - 1;
+				Delta &d = *deltas[idx];
+				const uint64_t t = d.ticket.load(std::memory_order_acquire);
+				// a range still hot fills its delta well within cool_fill_ns,
+				// checking twice per period leaves nothing buffered for much
+				// longer than that
+				if (Delta::pos(t) < d.capacity &&
+						now_ns() - d.attached_ns.load(std::memory_order_relaxed) > config.cool_fill_ns)
+					fold_gen(idx, Delta::gen(t), true);
+			}
+		}
+	}
+
+	// every version below this is in the tree
+	long durable_version() {
+		long w = next_version.load();
+		uint64_t a = attached.load();
+		while (a) {
+			const int idx = __builtin_ctzll(a);
+			a &= a - 1;
+			// a detached delta was folded, the entries of one about to open
+			// will be newer than every tombstone so far
+			const long b = deltas[idx]->base.load();
+			if (b != Delta::DETACHED)
+				w = std::min(w, b + 1);
+		}
+		return w;
+	}
+
+	// physically remove the tombstones no older write can overtake anymore
+	void compact() {
+		if (tombstones.empty())
+			return;
+		const long durable = durable_version();
+		tombstones.compact(durable, [this, durable] (K key, long) {
+			Tree::remove_if(key, [durable] (const Versioned<V> &p) {
+				return p.tombstone && p.version < durable;
+			});
+		});
+	}
+
+	enum class Append {
+		Done,
+		// the delta covers the key but can't take it right now, the key must
+		// not go to the tree directly until it can
+		Busy,
+		// the delta doesn't cover the key
+		Missed
+	};
+
+	Append append(Delta &d, const int idx, const K key, const V payload, const bool tombstone) {
+		const uint64_t t0 = d.ticket.load(std::memory_order_acquire);
+		// torn only while the delta is detached and closed, a wrong miss
+		// then is as good as one before the detach
+		if (!d.range().contains(key))
+			return Append::Missed;
+		if (Delta::pos(t0) >= d.capacity)
+			return Append::Busy;
+
+		const uint64_t t = d.ticket.fetch_add(1);
+		const long pos = Delta::pos(t);
+		if (pos >= d.capacity)
+			return Append::Busy;
+		// the delta was reopened or reattached after the check above, the
+		// slot still has to be published for the fold
+		const bool live = Delta::gen(t) == Delta::gen(t0);
+		d.slots[pos].write(key, payload, tombstone, live, d.base.load(std::memory_order_relaxed) + 1 + pos);
+		if (pos == d.capacity - 1)
+			fold(d, idx, d.capacity, false);
+		return live ? Append::Done : Append::Busy;
+	}
+
+	// BTree::insert that also tracks the fences of the leaf it reaches, returns
+	// false if the key's range was found to be hot and got a delta instead. A
+	// tombstone removes the key's entry.
+	bool insert_direct(K k, V payload, const long version, const bool tombstone) {
+		int restartCount = 0;
+	restart:
+		if (restartCount++)
+			this->yield(restartCount);
+		bool needRestart = false;
+		Range range;
+
+		// Current node
+		NodeBase* node = this->root;
+		uint64_t versionNode = node->readLockOrRestart(needRestart);
+		if (needRestart && held(node, range))
+			return false;
+		if (needRestart || (node!=this->root)) goto restart;
+
+		// Parent of current node
+		BTreeInner<K>* parent = nullptr;
+		uint64_t versionParent;
+
+		while (node->type==PageType::BTreeInner) {
+			auto inner = static_cast<BTreeInner<K>*>(node);
+
+			// Split eagerly if full
+			if (inner->isFull()) {
+				// Lock
+				if (parent) {
+					parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+					if (needRestart) goto restart;
+				}
+				node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+				if (needRestart) {
+					if (parent)
+						parent->writeUnlock();
+					goto restart;
+				}
+				if (!parent && (node != this->root)) { // there's a new parent
+					node->writeUnlock();
+					goto restart;
+				}
+				// Split
+				K sep; BTreeInner<K>* newInner = inner->split(sep);
+				if (parent)
+					parent->insert(sep,newInner);
+				else
+					this->makeRoot(sep,inner,newInner);
+				// Unlock and restart
+				node->writeUnlock();
+				if (parent)
+					parent->writeUnlock();
+				goto restart;
+			}
+
+			if (parent) {
+				parent->readUnlockOrRestart(versionParent, needRestart);
+				if (needRestart) goto restart;
+			}
+
+			parent = inner;
+			versionParent = versionNode;
+
+			unsigned pos = inner->lowerBound(k);
+			// narrow the fences to the child
+			if (pos > 0) {
+				range.lo = inner->keys[pos-1];
+				range.has_lo = true;
+			}
+			if (pos < inner->count) {
+				range.hi = inner->keys[pos];
+				range.has_hi = true;
+			}
+			node = inner->children[pos];
+			inner->checkOrRestart(versionNode, needRestart);
+			if (needRestart) goto restart;
+			versionNode = node->readLockOrRestart(needRestart);
+			if (needRestart && held(node, range))
+				return false;
+			if (needRestart) goto restart;
+		}
+
+		auto leaf = static_cast<BTreeLeaf<K,Versioned<V>>*>(node);
+
+		// Split leaf if full
+		if (leaf->count==leaf->maxEntries) {
+			// Lock
+			if (parent) {
+				parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+				if (needRestart) goto restart;
+			}
+			node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+			if (needRestart) {
+				if (parent) parent->writeUnlock();
+				goto restart;
+			}
+			if (!parent && (node != this->root)) { // there's a new parent
+				node->writeUnlock();
+				goto restart;
+			}
+			// Split
+			K sep; BTreeLeaf<K,Versioned<V>>* newLeaf = leaf->split(sep);
+			if (parent)
+				parent->insert(sep, newLeaf);
+			else
+				this->makeRoot(sep, leaf, newLeaf);
+			// Unlock and restart
+			node->writeUnlock();
+			if (parent)
+				parent->writeUnlock();
+			goto restart;
+		} else {
+			// only lock leaf node
+			node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+			if (needRestart) {
+				if (note_contention(node, range))
+					return false;
+				goto restart;
+			}
+			if (parent) {
+				parent->readUnlockOrRestart(versionParent, needRestart);
+				if (needRestart) {
+					node->writeUnlock();
+					goto restart;
+				}
+			}
+			if (tombstone) {
+				// no delta covers the key, so every older write is in the
+				// tree already and the entry can go right away
+				unsigned pos = leaf->lowerBound(k);
+				if ((pos<leaf->count) && (leaf->keys[pos]==k) && (leaf->payloads[pos].version <= version))
+					leaf->erase(pos);
+			} else {
+				leaf->insert(k, Versioned<V>(payload, version));
+			}
+			node->writeUnlock();
+			return true; // success
+		}
+	}
+
+	void write(K key, V payload, const bool tombstone) {
+		int restartCount = 0;
+		while (true) {
+			const long version = next_version.load();
+			uint64_t a = attached.load();
+			Delta *busy = nullptr;
+			while (a && !busy) {
+				const int idx = __builtin_ctzll(a);
+				a &= a - 1;
+				switch (append(*deltas[idx], idx, key, payload, tombstone)) {
+					case Append::Done:
+						return;
+					case Append::Busy:
+						busy = deltas[idx].get();
+						break;
+					case Append::Missed:
+						break;
+				}
+			}
+			if (busy) {
+				// help fold the covering delta, or wait for it
+				if (!help(*busy))
+					this->yield(++restartCount);
+				continue;
+			}
+			if (insert_direct(key, payload, version, tombstone))
+				return;
+		}
+	}
+
+	public:
+		HotBufferedBTree(const HotBufferConfig &config = HotBufferConfig()) :
+			config(config.checked()), deltas(new std::unique_ptr<Delta>[this->config.max_deltas]),
+			attached(0), next_version(0) {
+			for (auto &h : heat)
+				h.store(0, std::memory_order_relaxed);
+			if (this->config.cool_fill_ns > 0)
+				cooler = std::jthread([this] (std::stop_token stop) { fold_cool(stop); });
+		}
+
+		~HotBufferedBTree() {
+			if (cooler.joinable()) {
+				cooler.request_stop();
+				cooler.join();
+			}
+		}
+
+		void insert(K key, V payload) {
+			write(key, payload, false);
+		}
+
+		// a tombstone goes wherever an insert of the key would, it is
+		// removed from the tree once no older write can overtake it
+		void remove(K key) {
+			write(key, V(), true);
+		}
+
+		bool lookup(const K key, V &result) {
+			bool found = false;
+			Versioned<V> vres, r;
+			vres.version = -1;
+			r.version = -1;
+
+			uint64_t a = attached.load(std::memory_order_acquire);
+			while (a) {
+				const int idx = __builtin_ctzll(a);
+				a &= a - 1;
+				if (deltas[idx]->search(key, vres))
+					found = true;
+			}
+
+			if (Tree::lookup(key, r)) {
+				vres.set(r);
+				found = true;
+			}
+			if (found && !vres.tombstone) {
+				result = vres.val;
+				return true;
+			}
+			return false;
+		}
+
+		// up to range entries with keys >= key in key order, including the
+		// ones in delta buffers
+		uint64_t scan(K key, int range, K *keys, V *output) {
+			MergedScan<K,Versioned<V>> merged;
+			uint64_t a = attached.load(std::memory_order_acquire);
+			while (a) {
+				const int idx = __builtin_ctzll(a);
+				a &= a - 1;
+				deltas[idx]->collect(key, merged);
+			}
+
+			return merged.run(key, range, [this] (K k, int r, K *ks, Versioned<V> *vs, bool inclusive) {
+				return Tree::scan(k, r, ks, vs, inclusive);
+			}, keys, output);
+		}
+
+		uint64_t scan(K key, int range, V *output) {
+			std::unique_ptr<K[]> keys(new K[std::max(range, 1)]);
+			return scan(key, range, keys.get(), output);
+		}
+
+		// Fold every entry buffered before the call into the tree, the deltas
+		// stay attached. Open generations are closed and folded here, ones
+		// closed by another thread are helped along.
+		void flush() {
+			uint64_t a = attached.load();
+			while (a) {
+				const int idx = __builtin_ctzll(a);
+				a &= a - 1;
+				fold_gen(idx, Delta::gen(deltas[idx]->ticket.load()), false);
+			}
+		}
+
+		// fold and detach every delta, for when writes have stopped
+		void quiesce() {
+			while (uint64_t a = attached.load()) {
+				while (a) {
+					const int idx = __builtin_ctzll(a);
+					a &= a - 1;
+					fold_gen(idx, Delta::gen(deltas[idx]->ticket.load()), true);
+				}
+			}
+		}
+
+		// number of key ranges currently buffered
+		int hot_ranges() const {
+			return __builtin_popcountll(attached.load());
+		}
+};
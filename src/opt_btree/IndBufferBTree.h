@@ -2,169 +2,321 @@
 #include "BTreeOLC.h"
 #include<atomic>
 #include<memory>
-#include<array>
-#include<shared_mutex>
+#include<mutex>
+#include<vector>
 #include<utility>
-#include<optional>
-#include "omp.h"
+#include<algorithm>
+#include<functional>
+#include<immintrin.h>
+#include "ThreadRegistry.h"
+#include "MergedScan.h"
 
 using namespace btreeolc;
 
 
 
 template<class K, class V>
-class IndBufferedBTree : public BTree<K, V> {
-	public:
-		static constexpr int capacity = 12;
+class IndBufferedBTree : public BTree<K, Versioned<V>> {
+	// Every thread appends to a buffer of its own and flushes it itself once
+	// it is full, so writers share no buffer cache lines. Writes to the same
+	// key are ordered by a version drawn from one of a set of striped
+	// counters picked by the key's hash, versions of different keys are
+	// never compared. Leaves keep the newest version of each key, so buffers
+	// are flushed independently of each other.
+	struct Buffer {
+		static constexpr uint64_t CLOSED = 1UL << 31;
 
-	struct alignas(128) Buffer {
-		static constexpr int capacity = 255;
-		long size = 0;
-		std::array<std::pair<K,V>, capacity> buf;
-		
-		bool is_full() const {
-			return size == capacity;
-		}
-		bool is_empty() const {
-			return size == 0;
-		}
+		struct Slot {
+			// 0 while the slot is written, published last
+			std::atomic<long> version;
+			std::atomic<K> key;
+			std::atomic<V> val;
 
-		const std::pair<K,V> *begin() const{
-			return &buf[0];
-		}
-		const std::pair<K,V> *end() const {
-			return &buf[size];
-		}
+			void write(const K k, const V v, const long ver) {
+				version.store(0, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_release);
+				key.store(k, std::memory_order_relaxed);
+				val.store(v, std::memory_order_relaxed);
+				version.store(ver, std::memory_order_release);
+			}
 
-		void push_back(K key, V val) {
-			buf[size].first = key;
-			buf[size].second = val;
-			++size;
+			// false if the slot is being written
+			bool read(K &k, Versioned<V> &out) const {
+				const long v = version.load(std::memory_order_acquire);
+				if (!v)
+					return false;
+				k = key.load(std::memory_order_relaxed);
+				out.val = val.load(std::memory_order_relaxed);
+				out.version = v;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				return version.load(std::memory_order_relaxed) == v;
+			}
+		};
+
+		// held while the buffer is flushed
+		std::mutex mu;
+		// generation in the high half, next slot in the low half. Normally
+		// only the owning thread adds to it, but a thread that lost its
+		// buffer to a flush may still reserve a slot after it was handed on.
+		std::atomic<uint64_t> ticket;
+		// slots written so far, a flusher waits for the reserved ones
+		std::atomic<long> written;
+		// slots readers look at once the buffer is closed, 0 after the flush
+		std::atomic<long> filled;
+		const long capacity;
+		std::unique_ptr<Slot[]> slots;
+
+		Buffer(const long capacity) :
+			mu(), ticket(CLOSED), written(0), filled(0), capacity(capacity), slots(new Slot[capacity]()) {
 		}
 
-		std::pair<K, V> &operator[](const int pos) { 
-			return buf[pos];
+		static uint32_t gen(const uint64_t t) {
+			return t >> 32;
+		}
+		static long pos(const uint64_t t) {
+			return t & 0xffffffff;
 		}
 
-		bool search(K key, V &result) const {
-			long sz = size;
+		// slots that may hold entries not in the tree yet
+		long size() const {
+			const uint64_t t = ticket.load(std::memory_order_acquire);
+			if (pos(t) >= (long)CLOSED)
+				return filled.load(std::memory_order_acquire);
+			return std::min(pos(t), capacity);
+		}
 
-			if (!sz) 
+		// false if the buffer is full or closed
+		bool push_back(K key, V val, long version) {
+			const long p = pos(ticket.fetch_add(1, std::memory_order_acquire));
+			if (p >= capacity)
 				return false;
+			slots[p].write(key, val, version);
+			written.fetch_add(1, std::memory_order_release);
+			return true;
+		}
 
-			for (int i = 0; i < sz; ++i) {
-				if (buf[i].first == key) {
-					result = buf[i].second;
-					return true;
+		// Slots of an earlier generation are in the tree already, reading
+		// one is harmless, the tree is read afterwards and wins by version.
+		bool search(K key, Versioned<V> &result) const {
+			bool found = false;
+			const long end = size();
+			K k;
+			Versioned<V> r;
+			for (long i = 0; i < end; ++i) {
+				// cheap filter, the key is read again under the seqlock
+				if (slots[i].key.load(std::memory_order_relaxed) != key)
+					continue;
+				if (slots[i].read(k, r) && k == key) {
+					result.set(r);
+					found = true;
 				}
 			}
-			return false;
+			return found;
 		}
 
-	};
+		// add the entries with keys >= key
+		void collect(K key, MergedScan<K,Versioned<V>> &merged) const {
+			const long end = size();
+			K k;
+			Versioned<V> r;
+			for (long i = 0; i < end; ++i) {
+				if (slots[i].read(k, r) && k >= key)
+					merged.add(k, r);
+			}
+		}
 
-	struct InsertBuffer {
-		std::shared_mutex mu;
-		std::array<Buffer, capacity> thread_bufs ;
-		
-		InsertBuffer() : mu() {
-			thread_bufs.fill(Buffer());
+		// stop handing out slots and wait for the reserved ones to be
+		// written, caller holds mu
+		void close() {
+			const uint64_t t = ticket.load(std::memory_order_relaxed);
+			// readers that see the buffer closed must not skip it before
+			// the flush is done
+			filled.store(capacity);
+			const long end = std::min(pos(ticket.exchange(((uint64_t)gen(t) << 32) | CLOSED)), capacity);
+			filled.store(end);
+			while (written.load(std::memory_order_acquire) < end)
+				_mm_pause();
 		}
 
-		bool push_back(K key, V val, int thread_num) {
-			auto &buf = thread_bufs[thread_num];
-			buf.push_back(key, val);
-			return buf.is_full();
+		// start a new generation for the next owner
+		void activate() {
+			written.store(0, std::memory_order_relaxed);
+			const uint64_t t = ticket.load(std::memory_order_relaxed);
+			ticket.store((uint64_t)(gen(t) + 1) << 32, std::memory_order_release);
 		}
 
-		bool search(K key, V &result) {
-			for (const auto &buf : thread_bufs) {
-				if (buf.search(key, result))
-					return true;
-			}
+		// the entries of a closed buffer are in the tree
+		void drained() {
+			filled.store(0, std::memory_order_release);
+		}
 
-			return false;
+		const Slot *begin() const {
+			return &slots[0];
+		}
+		// end of the slots of a closed buffer
+		const Slot *end() const {
+			return &slots[filled.load(std::memory_order_relaxed)];
 		}
-							
 	};
 
+	struct alignas(64) Stripe {
+		std::atomic<long> version {0};
+	};
+	static constexpr int stripe_bits = 10;
 
 	private:
-		std::atomic<InsertBuffer *>insert_buffer;
-		std::array<InsertBuffer *, capacity> last_insert_buffer;
+		using Base = BTree<K, Versioned<V>>;
+
+		// the buffer each thread appends to
+		PerThread<std::atomic<Buffer *>> active;
+		// every buffer ever allocated, indexed by allocation order, readers
+		// scan all of them, idle ones are empty
+		PerThread<std::atomic<Buffer *>, 64> buffers;
+		std::atomic<int> num_buffers;
+		// drained buffers waiting for an owner
+		std::mutex pool_mu;
+		std::vector<Buffer *> pool;
+		std::unique_ptr<Stripe[]> stripes;
+		// entries per thread buffer
+		const long buffer_capacity;
+
+		std::atomic<long> &stripe(const K key) {
+			const uint64_t h = std::hash<K>{}(key) * 0x9e3779b97f4a7c15UL;
+			return stripes[h >> (64 - stripe_bits)].version;
+		}
+
+		// an activated buffer from the pool, or a new one
+		Buffer *take() {
+			std::lock_guard<std::mutex> lk(pool_mu);
+			Buffer *buf;
+			if (!pool.empty()) {
+				buf = pool.back();
+				pool.pop_back();
+			} else {
+				buf = new Buffer(buffer_capacity);
+				const int n = num_buffers.load(std::memory_order_relaxed);
+				buffers.get(n).store(buf, std::memory_order_release);
+				num_buffers.store(n + 1, std::memory_order_release);
+			}
+			buf->activate();
+			return buf;
+		}
+
+		void give_back(Buffer *buf) {
+			std::lock_guard<std::mutex> lk(pool_mu);
+			pool.push_back(buf);
+		}
+
+		void flush(Buffer &buf) {
+			std::lock_guard<std::mutex> lk(buf.mu);
+			buf.close();
+			for (const auto &s : buf) {
+				Base::insert(s.key.load(std::memory_order_relaxed), Versioned<V>(
+							s.val.load(std::memory_order_relaxed), s.version.load(std::memory_order_relaxed)));
+			}
+			buf.drained();
+		}
+
+		// Give the thread owning slot a fresh buffer and flush buf into the
+		// tree, false if another thread swapped it out first.
+		bool swap_out(std::atomic<Buffer *> &slot, Buffer *buf) {
+			Buffer *fresh = take();
+			if (!slot.compare_exchange_strong(buf, fresh)) {
+				give_back(fresh);
+				return false;
+			}
+			flush(*buf);
+			give_back(buf);
+			return true;
+		}
+
+		template<class F>
+		void for_each_buffer(F f) {
+			const int n = num_buffers.load(std::memory_order_acquire);
+			for (int i = 0; i < n; ++i)
+				f(*buffers.get(i).load(std::memory_order_acquire));
+		}
 
 	public:
 
-		IndBufferedBTree() : insert_buffer(new InsertBuffer()) {
-			BTree<K,V>();
-			last_insert_buffer.fill(nullptr);
+		IndBufferedBTree(const long buffer_capacity = 255) :
+			num_buffers(0), stripes(new Stripe[1 << stripe_bits]),
+			buffer_capacity(std::max(buffer_capacity, 1L)) {
+		}
 
+		~IndBufferedBTree() {
+			for (int i = 0; i < num_buffers.load(); ++i)
+				delete buffers.get(i).load();
 		}
-		
+
 		void insert(K key, V payload) {
-			int tnum = omp_get_thread_num();
-			start_insert:
-			InsertBuffer *curr_buffer = nullptr;
-			// grab the next valid buffer		
-			while (!(curr_buffer = this->insert_buffer.load()))
-				insert_buffer.wait(nullptr);
-			
-			// check if this thread has a lock on the current buffer
-			if (curr_buffer != last_insert_buffer[tnum]) {
-				// unlock the last buffer that was inserted into
-				if (last_insert_buffer[tnum]) {
-					last_insert_buffer[tnum]->mu.unlock_shared();
-					last_insert_buffer[tnum] = nullptr;
-				}
-				// try to lock the current buffer
-				if (curr_buffer->mu.try_lock_shared()) 
-					// if successful, update the last buffer inserted into
-					last_insert_buffer[tnum] = curr_buffer;
-				 else {
-					// if not successful restart insert
-					last_insert_buffer[tnum] = nullptr;
-					goto start_insert;
+			// taken before the entry is visible anywhere, a write that
+			// starts after this one returns gets a larger version
+			const long version = stripe(key).fetch_add(1) + 1;
+			std::atomic<Buffer *> &mine = active.local();
+			while (true) {
+				Buffer *buf = mine.load(std::memory_order_acquire);
+				if (!buf) {
+					// first insert from this thread
+					mine.store(take(), std::memory_order_release);
+					continue;
 				}
+				if (buf->push_back(key, payload, version))
+					return;
+				// full, or closed by flush() on another thread
+				swap_out(mine, buf);
 			}
+		}
 
-			if (curr_buffer->push_back(key, payload, tnum)) {
-				// this thread's buffer is full
-				curr_buffer->mu.unlock_shared();
-				last_insert_buffer[tnum] = nullptr;
-
-				if (insert_buffer.compare_exchange_strong(curr_buffer, nullptr)) {
-					// this thread has to insert everything 
-					insert_buffer = new InsertBuffer();
-					insert_buffer.notify_all();
-					//wait for other threads to complete inserting
-					curr_buffer->mu.lock();
-
-					for (const auto &buf : curr_buffer->thread_bufs) {
-						for (const auto &p : buf) {
-							BTree<K,V>::insert(p.first, p.second);
-						}
-					}
-					curr_buffer->mu.unlock();
-					delete curr_buffer;
-
-				} 				
-			}
-			// if the buffer has been swapped, unlock the last buffer that
-			// was inserted into
-			if (curr_buffer && (curr_buffer != insert_buffer.load())) {
-					curr_buffer->mu.unlock_shared();
-					last_insert_buffer[tnum] = nullptr;
+		bool lookup(const K key, V &result) {
+			bool found = false;
+			Versioned<V> vres, r;
+			vres.version = -1;
+
+			for_each_buffer([&] (const Buffer &buf) {
+				if (buf.search(key, vres))
+					found = true;
+			});
+			// anything flushed meanwhile is seen here
+			if (Base::lookup(key, r)) {
+				vres.set(r);
+				found = true;
 			}
-			
+			if (found)
+				result = vres.val;
+			return found;
 		}
-		
-		bool lookup(const K key, V &result) {
-			// FIXME this is incorrect;
-			auto *buf = insert_buffer.load();
-			if (buf && buf->search(key, result))
-				return true;
 
-			return BTree<K,V>::lookup(key, result);
+		// up to range entries with keys >= key in key order, including the
+		// buffered ones
+		uint64_t scan(K key, int range, K *keys, V *output) {
+			MergedScan<K,Versioned<V>> merged;
+			for_each_buffer([&] (const Buffer &buf) {
+				buf.collect(key, merged);
+			});
+
+			return merged.run(key, range, [this] (K k, int r, K *ks, Versioned<V> *vs, bool inclusive) {
+				return Base::scan(k, r, ks, vs, inclusive);
+			}, keys, output);
+		}
+
+		uint64_t scan(K key, int range, V *output) {
+			std::unique_ptr<K[]> keys(new K[std::max(range, 1)]);
+			return scan(key, range, keys.get(), output);
+		}
 
+		// Push every entry buffered before the call into the tree, including
+		// the buffers of threads that stopped inserting.
+		void flush() {
+			active.for_each([this] (std::atomic<Buffer *> &slot) {
+				Buffer *buf = slot.load(std::memory_order_acquire);
+				if (buf && buf->size())
+					swap_out(slot, buf);
+			});
+			// buffers swapped out by other threads finish flushing
+			for_each_buffer([] (Buffer &buf) {
+				buf.mu.lock();
+				buf.mu.unlock();
+			});
 		}
 };
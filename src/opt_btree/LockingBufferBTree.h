@@ -5,6 +5,11 @@
 #include<shared_mutex>
 #include<utility>
 #include<optional>
+#include<algorithm>
+#include<limits>
+#include<memory>
+#include "MergedScan.h"
+#include "TailDirectory.h"
 
 using namespace btreeolc;
 
@@ -23,131 +28,208 @@ class LockingBufferedBTree : public BTree<K, V> {
 			return {leaf, pos+i, low_key};
 		}
 	};
-	private:
+	// one unsorted tail leaf and the low key above which it takes inserts,
+	// every key prefix gets its own, swapped out under its own lock
+	struct alignas(64) Tail {
 		std::atomic<int> insert_count;
 		std::atomic<int> pos;
-		std::atomic<long> low_key;
+		std::atomic<K> low_key;
 		std::atomic<BTreeLeaf<K,V> *> leaf;
 		std::shared_mutex buff_mutex;
+
+		Tail(BTreeLeaf<K,V> *leaf) :
+			insert_count(0), pos(0), low_key(std::numeric_limits<K>::lowest()), leaf(leaf) {
+		}
+	};
+
+	private:
+		TailDirectory<K, Tail> tails;
 		
 		
 		BTreeLeaf<K,V> *allocate_new_leaf() {
 			auto leaf = new BTreeLeaf<K,V>();
 			leaf->count = 0;
-			// clear the memory 
-			//std::memset(leaf->keys, 0, sizeof(BTreeLeaf<K,V>::keys));
+			// tail keys are above the low key, scans skip slots that were
+			// reserved but not written yet
+			std::fill(std::begin(leaf->keys), std::end(leaf->keys), std::numeric_limits<K>::lowest());
 			//std::memset(leaf->payloads, 0, sizeof(BTreeLeaf<K,V>::payloads));
 			return leaf;
 		}
+
+		// the tree starts out empty, plain inserts need a leaf to go to
+		void ensure_root() {
+			if (!this->root.load()) {
+				NodeBase *null = nullptr;
+				auto *leaf = allocate_new_leaf();
+				if (!this->root.compare_exchange_strong(null, leaf))
+					delete leaf;
+			}
+		}
 		
 
 	public:
-		// 75% load factor on bulk inserted leaves
-		static const int max_inserts = BTreeLeaf<K,V>::maxEntries * .75;
+		// last slot of the tail leaf, set from the load factor of bulk
+		// inserted leaves
+		const int max_inserts;
 		
-		LockingBufferedBTree() : insert_count(0), pos(0), low_key(-1), leaf(allocate_new_leaf()) {
+		// the default prefix_shift puts every non negative key in one tail
+		LockingBufferedBTree(const double load_factor = .75,
+				const int prefix_shift = sizeof(K) * 8 - 1, const int max_tails = 64) :
+			tails(prefix_shift, max_tails),
+			max_inserts(std::clamp<int>(BTreeLeaf<K,V>::maxEntries * load_factor, 1, BTreeLeaf<K,V>::maxEntries - 1)) {
 			this->root = nullptr;
 		}
 
 		
 		void insert(K key, V payload) {
+			Tail *tail = tails.find(key, [this] { return new Tail(allocate_new_leaf()); });
+			if (!tail) {
+				ensure_root();
+				BTree<K, V>::insert(key, payload);
+				return;
+			}
+
 			start_insert:
-			if (key > low_key.load()) {
-				buff_mutex.lock_shared();
+			if (key > tail->low_key.load()) {
+				tail->buff_mutex.lock_shared();
 
-				if (key <= low_key.load()) {
-					buff_mutex.unlock_shared();
+				if (key <= tail->low_key.load()) {
+					tail->buff_mutex.unlock_shared();
+					ensure_root();
 					BTree<K, V>::insert(key, payload);
 					return;
 				}
-				BTreeLeaf<K,V> *current_leaf = leaf.load();
+				BTreeLeaf<K,V> *current_leaf = tail->leaf.load();
 
-				long current_pos = pos++;
+				long current_pos = tail->pos++;
 				if (current_pos > max_inserts) {
-					buff_mutex.unlock_shared();
+					tail->buff_mutex.unlock_shared();
 					std::this_thread::yield();
 					goto start_insert;
 				}
 
-				buff_mutex.unlock_shared();
+				tail->buff_mutex.unlock_shared();
 
 
 				if (current_pos < max_inserts) {
 					current_leaf->insert_unordered(key, payload, current_pos);
-					++insert_count;
+					++tail->insert_count;
 
 				} else if (current_pos == max_inserts) {
 					current_leaf->insert_unordered(key, payload, current_pos);
-					++insert_count;
+					++tail->insert_count;
 					// wait for threads to finish inserts				
-					while(insert_count != max_inserts + 1);
+					while(tail->insert_count != max_inserts + 1);
 
 					current_leaf->count = max_inserts + 1;
 					K high_key = current_leaf->sort_and_dedupe();
-					insert_leaf(current_leaf);
+					const bool linked = insert_leaf(current_leaf);
 
 					
-					insert_count = 0;
+					tail->insert_count = 0;
 
-					buff_mutex.lock();
-					low_key = high_key;
-					leaf = allocate_new_leaf();
-					pos = 0;
-					buff_mutex.unlock();
+					tail->buff_mutex.lock();
+					tail->low_key = high_key;
+					tail->leaf = allocate_new_leaf();
+					tail->pos = 0;
+					tail->buff_mutex.unlock();
+					// readers only use the tail leaf under the lock
+					if (!linked)
+						delete current_leaf;
 				} 	
 			} else {
 				// insert normally into the tree
+				ensure_root();
 				BTree<K, V>::insert(key, payload);
 			}
 		}
 		
 		bool lookup(const K key, V &result) {
-			// TODO this is probably wrong
-			auto *current_leaf = leaf.load();
-			const K current_low_key = low_key;
-
-			if (key <= current_low_key) {
-				return BTree<K,V>::lookup(key, result);
-			} 
-			auto count = pos + 1;
-			auto res = current_leaf->search_unsorted(key, count, result);
-			//TODO what happens when the leaf is split?
-			if (current_leaf != leaf) {
-				// leaf was inserted into the tree
-				// wait for insert to complete
-				bool needRestart;
-				// try reading the leaf
-				do {
-					needRestart = false;
-					uint64_t versionNode = current_leaf->readLockOrRestart(needRestart);
-					if (needRestart)
-						continue;
-
-					int pos = current_leaf->lowerBound(key);
-					if ((pos<current_leaf->count) && (current_leaf->keys[pos]==key)) {
-						result = current_leaf->payloads[pos];
-						current_leaf->readUnlockOrRestart(versionNode, needRestart);
-						if (needRestart)
-							continue;
-						else
-							return true;
-
-					} else {
-						// read failed on leaf, might have been split
-						// try normal read
-						return BTree<K,V>::lookup(key, result);
-					}
+			Tail *tail = tails.find(key);
+			if (!tail)
+				return this->root.load() && BTree<K,V>::lookup(key, result);
 
-				} while(needRestart);
+			start_lookup:
+			tail->buff_mutex.lock_shared();
+			// the tail can only be swapped out under the exclusive lock
+			const long current_pos = tail->pos.load();
+			if (current_pos > max_inserts) {
+				// the tail is being sorted and inserted
+				tail->buff_mutex.unlock_shared();
+				std::this_thread::yield();
+				goto start_lookup;
+			}
+			if (key <= tail->low_key.load()) {
+				tail->buff_mutex.unlock_shared();
+				return this->root.load() && BTree<K,V>::lookup(key, result);
+			}
+			const bool found = tail->leaf.load()->search_unsorted(key, current_pos, result);
+			if (tail->pos.load() > max_inserts) {
+				// the sort may have started while searching
+				tail->buff_mutex.unlock_shared();
+				goto start_lookup;
+			}
+			tail->buff_mutex.unlock_shared();
+			return found;
+		}
+
+		// up to range entries with keys >= key in key order, including the
+		// ones in the tail leaves
+		uint64_t scan(K key, int range, K *keys, V *output) {
+			MergedScan<K,V> merged;
+			tails.for_each([this, key, &merged] (Tail &tail) {
+				start_collect:
+				tail.buff_mutex.lock_shared();
+				// the tail can only be swapped out under the exclusive lock
+				const long current_pos = tail.pos.load();
+				if (current_pos > max_inserts) {
+					// the tail is being sorted and inserted
+					tail.buff_mutex.unlock_shared();
+					std::this_thread::yield();
+					goto start_collect;
+				}
+				BTreeLeaf<K,V> *current_leaf = tail.leaf.load();
+				const K current_low_key = tail.low_key.load();
+				const size_t m = merged.mark();
+				for (long i = 0; i < current_pos; ++i) {
+					const K k = current_leaf->keys[i];
+					if (k > current_low_key && k >= key)
+						merged.add(k, current_leaf->payloads[i]);
+				}
+				if (tail.pos.load() > max_inserts) {
+					// the last slot was taken while copying, the sort may have
+					// started
+					tail.buff_mutex.unlock_shared();
+					merged.rollback(m);
+					goto start_collect;
+				}
+				tail.buff_mutex.unlock_shared();
+			});
+
+			return merged.run(key, range, [this] (K k, int r, K *ks, V *vs, bool inclusive) -> uint64_t {
+				if (!this->root.load())
+					return 0;
+				return BTree<K,V>::scan(k, r, ks, vs, inclusive);
+			}, keys, output);
+		}
+
+		uint64_t scan(K key, int range, V *output) {
+			std::unique_ptr<K[]> keys(new K[std::max(range, 1)]);
+			return scan(key, range, keys.get(), output);
+		}
 
-			}	
-			return res;
+		// insert the entries of a sorted tail leaf one by one
+		void copy_leaf(BTreeLeaf<K, V> *new_leaf) {
+			for (unsigned i = 0; i < new_leaf->count; ++i)
+				BTree<K, V>::insert(new_leaf->keys[i], new_leaf->payloads[i]);
 		}
 
-		void insert_leaf(BTreeLeaf<K, V> *new_leaf) {
+		// links a sorted tail leaf into the tree, false if its entries had
+		// to be copied in instead
+		bool insert_leaf(BTreeLeaf<K, V> *new_leaf) {
 			NodeBase *null = nullptr;
 			if (this->root.compare_exchange_strong(null, new_leaf)) {
-				return;
+				return true;
 			}
 		
 			K k = new_leaf->keys[new_leaf->count-1];
@@ -232,6 +314,15 @@ class LockingBufferedBTree : public BTree<K, V> {
 					goto restart;
 				}
 				auto leaf = static_cast<BTreeLeaf<K,V>*>(node);
+				if (!leaf->count || !(leaf->keys[leaf->count-1] < new_leaf->keys[0])) {
+					// another tail's keys are in the way, the leaf can't be
+					// linked in as is
+					node->writeUnlock();
+					if (parent)
+						parent->writeUnlock();
+					copy_leaf(new_leaf);
+					return false;
+				}
 				if (parent)
 					parent->insert(leaf->keys[leaf->count-1], new_leaf);
 				else
@@ -244,7 +335,7 @@ class LockingBufferedBTree : public BTree<K, V> {
 				leaf_inserted = true;
 				goto restart;
 			} else {
-				return; // success
+				return true; // success
 			}
 		}
 
@@ -0,0 +1,144 @@
+#pragma once
+#include "Versioned.h"
+#include<vector>
+#include<memory>
+#include<utility>
+#include<algorithm>
+
+
+// Merges entries that sit in insert buffers into a range scan of the tree.
+// Buffered entries have to be collected before the tree is scanned, a buffer
+// that is flushed in between is then still seen through the tree. Entries
+// with the same key are resolved by version for Versioned payloads, otherwise
+// buffered entries are newer than the tree and later added ones win. The
+// tree's payloads are T, plain payloads when only the buffers keep versions.
+template<class K, class P, class T = P>
+class MergedScan {
+	std::vector<std::pair<K,P>> buffered;
+
+	// whether a should replace b, b was seen earlier
+	static bool newer(const P &a, const P &b) {
+		if constexpr (is_versioned<P>::value)
+			return a.version >= b.version;
+		else
+			return true;
+	}
+
+	// whether a buffered entry replaces the tree's, the tree wins ties
+	// between versions like in lookup
+	static bool replaces(const P &buffered, const T &tree) {
+		if constexpr (is_versioned<P>::value && is_versioned<T>::value)
+			return buffered.version > tree.version;
+		else
+			return true;
+	}
+
+	template<class U>
+	static const U &unwrap(const U &p) {
+		return p;
+	}
+	template<class U>
+	static const U &unwrap(const Versioned<U> &p) {
+		return p.val;
+	}
+
+	public:
+		void add(const K &key, const P &payload) {
+			buffered.emplace_back(key, payload);
+		}
+
+		// entries added since the last mark, dropped with rollback when
+		// the buffer they came from turned out to be reused
+		size_t mark() const {
+			return buffered.size();
+		}
+		void rollback(const size_t m) {
+			buffered.resize(m);
+		}
+
+		// forget buffered entries the tree is known to have caught up with
+		template<class Pred>
+		void drop_if(Pred pred) {
+			size_t n = 0;
+			for (size_t i = 0; i < buffered.size(); ++i) {
+				if (!pred(buffered[i].second))
+					buffered[n++] = buffered[i];
+			}
+			buffered.resize(n);
+		}
+
+		// tree_scan(k, range, keys, payloads, inclusive) scans the tree and
+		// returns the number of entries, output gets the unwrapped payloads
+		// of everything that isn't a tombstone
+		template<class TreeScan, class Out>
+		uint64_t run(const K k, const int range, TreeScan &&tree_scan, K *keys, Out *output) {
+			// sort positions, Versioned can't be moved
+			std::vector<size_t> order;
+			for (size_t i = 0; i < buffered.size(); ++i) {
+				if (!(buffered[i].first < k))
+					order.push_back(i);
+			}
+			std::stable_sort(order.begin(), order.end(),
+					[this] (size_t a, size_t b) { return buffered[a].first < buffered[b].first; });
+			// keep the newest entry per key
+			size_t nb = 0;
+			for (size_t i = 0; i < order.size(); ++i) {
+				const auto &e = buffered[order[i]];
+				if (nb && buffered[order[nb-1]].first == e.first) {
+					if (newer(e.second, buffered[order[nb-1]].second))
+						order[nb-1] = order[i];
+				} else {
+					order[nb++] = order[i];
+				}
+			}
+			if (range <= 0)
+				return 0;
+
+			std::unique_ptr<K[]> tree_keys(new K[range]);
+			std::unique_ptr<T[]> tree_vals(new T[range]);
+			uint64_t n = 0;
+			size_t j = 0;
+			auto emit = [&] (const K &key, const auto &p) {
+				if constexpr (is_versioned<std::decay_t<decltype(p)>>::value) {
+					if (p.tombstone)
+						return;
+				}
+				keys[n] = key;
+				output[n++] = unwrap(p);
+			};
+
+			K from = k;
+			bool inclusive = true;
+			while (true) {
+				const uint64_t nt = tree_scan(from, range, tree_keys.get(), tree_vals.get(), inclusive);
+				// the tree may have more entries past the last one returned,
+				// buffered keys beyond it wait for the next round
+				const bool more = nt == (uint64_t)range;
+				uint64_t i = 0;
+				while (n < (uint64_t)range && (i < nt ||
+						(j < nb && (!more || !(tree_keys[nt-1] < buffered[order[j]].first))))) {
+					if (j == nb || (i < nt && tree_keys[i] < buffered[order[j]].first)) {
+						emit(tree_keys[i], tree_vals[i]);
+						++i;
+						continue;
+					}
+					const auto &b = buffered[order[j++]];
+					if (i == nt || b.first < tree_keys[i]) {
+						emit(b.first, b.second);
+					} else if (replaces(b.second, tree_vals[i])) {
+						emit(b.first, b.second);
+						++i;
+					} else {
+						emit(tree_keys[i], tree_vals[i]);
+						++i;
+					}
+				}
+				// tombstones took up part of the range
+				if (!more || n == (uint64_t)range)
+					break;
+				from = tree_keys[nt-1];
+				inclusive = false;
+			}
+			return n;
+		}
+};
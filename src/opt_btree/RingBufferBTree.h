@@ -7,204 +7,698 @@
 #include<utility>
 #include<optional>
 #include<algorithm>
-#include "omp.h"
+#include<limits>
+#include<mutex>
+#include<thread>
+#include<condition_variable>
+#include<stop_token>
+#include<immintrin.h>
+#include "ThreadRegistry.h"
+#include "BufferController.h"
+#include "MergedScan.h"
 
 using namespace btreeolc;
 
 
-template<class K, class V>
-class RingBufferedBTree : public BTree<K, Versioned<V>> {
+// Leaf picks the tree's leaf format, CompressedLeaf packs tail inserted
+// integer ids much tighter than BTreeLeaf.
+template<class K, class V, class Leaf = BTreeLeaf<K, V>>
+class RingBufferedBTree : public BTree<K, V, Leaf> {
+	// Versions are not drawn from a shared counter. Each time a buffer is
+	// activated it is handed a block of capacity versions starting after
+	// min_version, and the entry in slot i gets min_version + 1 + i. Blocks are
+	// handed out in activation order, so versions still follow the order in
+	// which slots were reserved, both within a buffer and across buffers.
+	//
+	// Writers reserve a slot with a single fetch_add on ticket, which holds the
+	// generation in the high half and the next slot in the low half, and
+	// publish the slot by writing its version last. A flusher closes the
+	// buffer by moving the slot counter past any capacity and waits for the
+	// reserved slots to be published, so writers never hold a lock. The
+	// version doubles as the slot's seqlock, a reader validates each slot on
+	// its own and never needs the buffer's generation to stay put.
+	//
+	// Closed buffers are applied to the tree one block at a time in version
+	// order, so the tree only ever holds the latest write of a key and its
+	// leaves store plain payloads. Versions live in the buffers alone.
+	//
+	// The type is public for micro.cpp to time on its own.
 	public:
-		static constexpr int max_threads = 32;
-		static constexpr int capacity_per_thread = 256;
+	struct InsertBuffer {
+		static constexpr uint64_t CLOSED = 1UL << 31;
 
+		struct Slot {
+			// 0 while the slot is written, published last, slots of
+			// earlier generations are at or below min_version
+			std::atomic<long> version;
+			std::atomic<K> key;
+			std::atomic<V> val;
+			std::atomic<bool> tombstone;
+			// cleared when the writer found the key had become a direct
+			// insert after reserving the slot, the write went to the tree
+			std::atomic<bool> live;
 
-	struct InsertBuffer {
-		static constexpr long capacity = 1024;
-		std::shared_mutex mu;
-		std::atomic<long> pos, min_version;
-		std::array<std::pair<K,Versioned<V>>, capacity> buf;
+			void write(const K k, const V v, const bool tomb, const bool is_live, const long ver) {
+				version.store(0, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_release);
+				key.store(k, std::memory_order_relaxed);
+				val.store(v, std::memory_order_relaxed);
+				tombstone.store(tomb, std::memory_order_relaxed);
+				live.store(is_live, std::memory_order_relaxed);
+				version.store(ver, std::memory_order_release);
+			}
+
+			// copy of a published live entry newer than min_version, false
+			// if there is none or a writer got in the way
+			bool read(const long min_version, K &k, Versioned<V> &out) const {
+				const long v = version.load(std::memory_order_acquire);
+				if (v <= min_version)
+					return false;
+				k = key.load(std::memory_order_relaxed);
+				out.val = val.load(std::memory_order_relaxed);
+				out.tombstone = tombstone.load(std::memory_order_relaxed);
+				const bool is_live = live.load(std::memory_order_relaxed);
+				out.version = v;
+				std::atomic_thread_fence(std::memory_order_acquire);
+				return is_live && version.load(std::memory_order_relaxed) == v;
+			}
+		};
+
+		enum class Push { Done, Full, Moved };
+
+		// held while the buffer is flushed or activated
+		std::mutex mu;
+		std::atomic<uint64_t> ticket;
+		std::atomic<long> min_version;
+		// number of slots used by the current generation, set on activation
+		std::atomic<long> capacity;
+		const long max_capacity;
+		std::unique_ptr<Slot[]> buf;
+		// slots readers look at once the buffer is closed, 0 after the flush
+		std::atomic<long> filled;
+		// when the current generation was activated
+		std::atomic<long> activated_ns;
+
+		// While a closed buffer is applied, the last write of each key
+		// sorted by key, split into chunks any thread can claim. work holds
+		// the flush's epoch in the high half, then the number of chunks and
+		// the next unclaimed one in 16 bits each.
+		std::unique_ptr<std::pair<K,uint32_t>[]> order;
+		long order_size;
+		long chunk_size;
+		std::atomic<uint64_t> work;
+		std::atomic<long> chunks_done;
 		
-		InsertBuffer() : mu(), buf(), pos(0), min_version(0) {
+		InsertBuffer(const long max_capacity) :
+			mu(), ticket(CLOSED), min_version(0), capacity(max_capacity),
+			max_capacity(max_capacity), buf(new Slot[max_capacity]()),
+			filled(0), activated_ns(0), order(new std::pair<K,uint32_t>[max_capacity]),
+			order_size(0), chunk_size(1), work(0), chunks_done(0) {
 		}
 
-		bool push_back(K key, V val, std::atomic<long> *version) {
-			long insert_pos = pos.fetch_add(1, std::memory_order_relaxed);
-			if (insert_pos < capacity) {
-				buf[insert_pos].first = key;
-				buf[insert_pos].second.val = val;
-				buf[insert_pos].second.version = version->fetch_add(1, std::memory_order_release);
-				return false;
+		static uint32_t gen(const uint64_t t) {
+			return t >> 32;
+		}
+		static long pos(const uint64_t t) {
+			return t & 0xffffffff;
+		}
+
+		// slots that may hold entries of the current generation and are not
+		// in the tree yet
+		long size(const uint64_t t) const {
+			if (pos(t) >= (long)CLOSED)
+				return filled.load(std::memory_order_acquire);
+			return std::min(pos(t), capacity.load(std::memory_order_relaxed));
+		}
+		long size() const {
+			return size(ticket.load(std::memory_order_acquire));
+		}
+
+		// end of the block of versions this generation was handed, the
+		// next block starts there
+		long end_version() const {
+			return min_version.load(std::memory_order_relaxed) + capacity.load(std::memory_order_relaxed) + 1;
+		}
+
+		// Moved if keys below buffered_key stopped being buffered after
+		// the slot was reserved, the slot is skipped and the caller has to
+		// write to the tree instead
+		Push push_back(K key, V val, bool tombstone, const std::atomic<K> &buffered_key) {
+			const long insert_pos = pos(ticket.fetch_add(1));
+			if (insert_pos < capacity.load(std::memory_order_relaxed)) {
+				const bool live = !(key < buffered_key.load());
+				buf[insert_pos].write(key, val, tombstone, live,
+						min_version.load(std::memory_order_relaxed) + 1 + insert_pos);
+				return live ? Push::Done : Push::Moved;
 			} else {
-				return true;
+				return Push::Full;
 			}
 		}
 
-		bool search(K key, Versioned<V> &result, const long max_version) {
+		// Entries left over from before the last activation have versions
+		// at or below min_version. If the buffer is reactivated meanwhile,
+		// the entries read from the old generation are in the tree and the
+		// caller drops them by version.
+		bool search(K key, Versioned<V> &result, long &scanned) {
 			bool found = false;
 
-			int end = std::min(pos.load(std::memory_order_relaxed), capacity);
-			long start_min_version;
-			if (!end || ((start_min_version = min_version.load()) >= max_version)) {
+			const uint64_t t = ticket.load(std::memory_order_acquire);
+			const long start_min_version = min_version.load();
+			const long end = size(t);
+			if (!end) {
 				return false;
 			}
+			scanned += end;
 
-			for (int i = 0; i < end; ++i) {
-				if (buf[i].first == key) {
-					long curr_min_version = min_version.load();
-					// strictly greater than because the version number gets incremented
-					// at least once before this buffer is resued
-					if( buf[i].second.version <= max_version &&
-						buf[i].second.version > curr_min_version) {
-
-						result.set(buf[i].second);
-						found = true;
-					} 
-					// ensure read was valid
-					if (start_min_version != min_version.load()) {
-						return false;
-					}
+			const Slot *slots = buf.get();
+			K k;
+			Versioned<V> r;
+			for (long i = 0; i < end; ++i) {
+				// cheap filter, the key is read again under the seqlock
+				if (slots[i].key.load(std::memory_order_relaxed) != key)
+					continue;
+				if (slots[i].read(start_min_version, k, r) && k == key) {
+					result.set(r);
+					found = true;
 				}
 			}
 			return found;
 		}
 
-		void reset(const long version) {
-			min_version = version;
-			pos = 0;
+		// add the entries with keys >= key
+		void collect(K key, MergedScan<K,Versioned<V>,V> &merged) {
+			const uint64_t t = ticket.load(std::memory_order_acquire);
+			const long start_min_version = min_version.load();
+			const long end = size(t);
+			K k;
+			Versioned<V> r;
+			for (long i = 0; i < end; ++i) {
+				if (buf[i].read(start_min_version, k, r) && k >= key)
+					merged.add(k, r);
+			}
+		}
+
+		// stop handing out slots and wait for the reserved ones to be
+		// written, caller holds mu
+		void close() {
+			const uint64_t t = ticket.load(std::memory_order_relaxed);
+			// readers that see the buffer closed must not skip it before
+			// the flush is done
+			filled.store(capacity.load(std::memory_order_relaxed));
+			const long end = std::min(pos(ticket.exchange(((uint64_t)gen(t) << 32) | CLOSED)),
+					capacity.load(std::memory_order_relaxed));
+			filled.store(end);
+			const long b = min_version.load(std::memory_order_relaxed);
+			for (long i = 0; i < end; ++i) {
+				while (buf[i].version.load(std::memory_order_acquire) <= b)
+					_mm_pause();
+			}
+		}
+
+		// hand this buffer the next block of versions, must happen before
+		// the buffer is published as the insert buffer
+		void activate(const long base_version, const long cap) {
+			capacity = std::min(cap, max_capacity);
+			min_version = base_version;
+			activated_ns.store(now_ns(), std::memory_order_relaxed);
+			const uint64_t t = ticket.load(std::memory_order_relaxed);
+			ticket.store((uint64_t)(gen(t) + 1) << 32, std::memory_order_release);
+		}
+
+		// the entries of a closed buffer are in the tree
+		void drained() {
+			filled.store(0, std::memory_order_release);
+		}
+
+		// sort the live slots of a closed buffer into order, keeping the
+		// last write of each key, and open the chunks for claiming
+		void plan(const long min_chunk) {
+			long n = 0;
+			const long end = filled.load(std::memory_order_relaxed);
+			for (long i = 0; i < end; ++i) {
+				if (buf[i].live.load(std::memory_order_relaxed))
+					order[n++] = {buf[i].key.load(std::memory_order_relaxed), (uint32_t)i};
+			}
+			// ties sort by slot, the later slot is the newer write
+			std::sort(&order[0], &order[n]);
+			long m = 0;
+			for (long i = 0; i < n; ++i) {
+				if (m && order[m-1].first == order[i].first)
+					order[m-1] = order[i];
+				else
+					order[m++] = order[i];
+			}
+			order_size = m;
+			chunk_size = std::max(min_chunk, m / 0xffff + 1);
+			const uint64_t chunks = (m + chunk_size - 1) / chunk_size;
+			chunks_done.store(0, std::memory_order_relaxed);
+			const uint64_t epoch = (work.load(std::memory_order_relaxed) >> 32) + 1;
+			work.store((epoch << 32) | (chunks << 16), std::memory_order_release);
+		}
+
+		static long chunks(const uint64_t w) {
+			return (w >> 16) & 0xffff;
+		}
+
+		// claim the next chunk of the current flush, -1 if none is left
+		long claim() {
+			uint64_t w = work.load(std::memory_order_acquire);
+			while ((long)(w & 0xffff) < chunks(w)) {
+				if (work.compare_exchange_weak(w, w + 1, std::memory_order_acquire))
+					return w & 0xffff;
+			}
+			return -1;
 		}
-							
+
+		// positions in order covered by chunk c
+		std::pair<long,long> chunk(const long c) const {
+			return {c * chunk_size, std::min(order_size, (c + 1) * chunk_size)};
+		}
+								
 	};
 
 
 	private:
+		using Base = BTree<K, V, Leaf>;
+
 		std::atomic<InsertBuffer *>insert_buffer;
-		std::array<InsertBuffer *, max_threads> last_insert_buffer;
-		std::array<InsertBuffer, max_threads> insert_buffers;
-		std::atomic<long> version;
+		// the ring, buffers are allocated the first time every existing
+		// buffer is busy and never freed before the tree is
+		std::unique_ptr<std::atomic<InsertBuffer *>[]> insert_buffers;
+		std::atomic<int> num_buffers;
+		std::mutex grow_mu;
+		// start of the next unassigned block of versions, only touched when
+		// a buffer is activated
+		std::atomic<long> next_version;
+		// every block below this is in the tree, also the base of the block
+		// that is applied next
+		std::atomic<long> applied_version;
+		// the buffer whose block is being applied, its chunks are up for
+		// grabs
+		std::atomic<InsertBuffer *> applying;
+		// slots per claimable chunk of a flush
+		static constexpr long flush_chunk = 64;
 
-	public:
+		// largest key flushed into the tree
+		std::atomic<K> tail_key;
+		// Keys below direct_key go straight to the tree, no buffered write
+		// to them is left. Keys below buffered_key are no longer buffered,
+		// but writes to keys between the two may still sit in the blocks
+		// below buffered_from. A write there waits for those blocks to be
+		// applied, buffered_from is LONG_MAX while it is being set. Both
+		// keys only ever increase.
+		std::atomic<K> direct_key;
+		std::atomic<K> buffered_key;
+		std::atomic<long> buffered_from;
 
-		RingBufferedBTree() : version(1) {
-			BTree<K,Versioned<V>>();
-			last_insert_buffer.fill(nullptr);
-			insert_buffer = insert_buffers.data();
-			for (auto &buf : insert_buffers)
-				buf.reset(0);
+		const BufferConfig config;
+		BufferController controller;
+		// inserters that could not use the current buffer
+		std::atomic<long> stalls;
+		struct LookupStats {
+			std::atomic<long> lookups, scanned;
+		};
+		PerThread<LookupStats> lookup_stats;
+
+		// flushes partially filled buffers once they are older than half of
+		// config.max_staleness_ns, only started if that is set
+		std::condition_variable_any staleness_cv;
+		std::mutex staleness_mu;
+		std::jthread staleness_flusher;
+
+		// append a buffer to the ring, nullptr if the ring is at max_buffers
+		InsertBuffer *add_buffer() {
+			std::lock_guard<std::mutex> lk(grow_mu);
+			int n = num_buffers.load(std::memory_order_relaxed);
+			if (n >= config.max_buffers)
+				return nullptr;
+			auto *buf = new InsertBuffer(config.max_buffer_capacity);
+			insert_buffers[n].store(buf, std::memory_order_release);
+			num_buffers.store(n + 1, std::memory_order_release);
+			return buf;
 		}
-		
-		void insert(K key, V payload) {
-			int tnum = omp_get_thread_num();
 
-			start_insert:
-			InsertBuffer *curr_buffer;
-			// grab the next valid buffer		
-			while (!(curr_buffer = this->insert_buffer.load(std::memory_order_relaxed)))
-				insert_buffer.wait(nullptr);
+		void activate(InsertBuffer &buf) {
+			const long cap = std::min(controller.next_capacity(), buf.max_capacity);
+			// base + cap + 1 is the next block's base, never a slot version
+			const long base = next_version.fetch_add(cap + 1, std::memory_order_relaxed);
+			buf.activate(base, cap);
+			insert_buffer.store(&buf);
+		}
+
+		static void store_max(std::atomic<K> &a, const K k) {
+			K curr = a.load(std::memory_order_relaxed);
+			while (curr < k && !a.compare_exchange_weak(curr, k));
+		}
 
-			if (curr_buffer != last_insert_buffer[tnum]) {
-				if (last_insert_buffer[tnum]) {
-					// unlock the last buffer that was inserted into
-					last_insert_buffer[tnum]->mu.unlock_shared();
-					last_insert_buffer[tnum] = nullptr;
+		// stop buffering keys below key, only called by the thread whose
+		// block is being applied
+		void stop_buffering(const K key) {
+			if (!(buffered_key.load(std::memory_order_relaxed) < key))
+				return;
+			// a writer that still buffers below key after this got its slot
+			// in a block handed out before next_version is read
+			buffered_from.store(std::numeric_limits<long>::max());
+			buffered_key.store(key);
+			buffered_from.store(next_version.load());
+		}
+
+		void apply_chunk(InsertBuffer &buf, const long c) {
+			const auto [from, to] = buf.chunk(c);
+			for (long i = from; i < to; ++i) {
+				const auto &s = buf.buf[buf.order[i].second];
+				// nothing older is left to overtake a delete
+				if (s.tombstone.load(std::memory_order_relaxed))
+					Base::remove_if(buf.order[i].first, [] (const V &) { return true; });
+				else
+					Base::insert(buf.order[i].first, s.val.load(std::memory_order_relaxed));
+			}
+		}
+
+		// apply a chunk of the buffer being flushed, false if there was
+		// nothing to claim
+		bool help() {
+			InsertBuffer *buf = applying.load(std::memory_order_acquire);
+			if (!buf)
+				return false;
+			const long c = buf->claim();
+			if (c < 0)
+				return false;
+			apply_chunk(*buf, c);
+			buf->chunks_done.fetch_add(1, std::memory_order_release);
+			return true;
+		}
+
+		// insert every slot of a closed buffer into the tree, with help from
+		// writers that are out of buffers, and learn where the contended
+		// tail starts
+		void flush(InsertBuffer &buf) {
+			buf.plan(flush_chunk);
+			applying.store(&buf, std::memory_order_release);
+			for (long c; (c = buf.claim()) >= 0;) {
+				apply_chunk(buf, c);
+				buf.chunks_done.fetch_add(1, std::memory_order_relaxed);
+			}
+			const long chunks = InsertBuffer::chunks(buf.work.load(std::memory_order_relaxed));
+			while (buf.chunks_done.load(std::memory_order_acquire) < chunks)
+				_mm_pause();
+			applying.store(nullptr, std::memory_order_relaxed);
+
+			if (!buf.order_size)
+				return;
+			const K prev_tail = tail_key.load(std::memory_order_relaxed);
+			const K max_key = buf.order[buf.order_size - 1].first;
+			if (max_key > prev_tail) {
+				// smallest key of this generation that extended the tree, for
+				// a sequential stream that is the start of the buffer, for
+				// random keys it is close to the maximum
+				const K min_extending = std::upper_bound(&buf.order[0], &buf.order[buf.order_size],
+						std::make_pair(prev_tail, std::numeric_limits<uint32_t>::max()))->first;
+				store_max(tail_key, max_key);
+				if (config.admission == Admission::Tail)
+					stop_buffering(min_extending);
+			}
+		}
+
+		// block until every block below version is in the tree
+		void wait_applied(const long version) {
+			while (true) {
+				const long a = applied_version.load();
+				if (a >= version)
+					return;
+				// the insert buffer may be the one holding things up and
+				// take arbitrarily long to fill
+				InsertBuffer *buf = insert_buffer.load();
+				if (buf && buf->min_version.load() < version)
+					rotate(buf, false);
+				else
+					applied_version.wait(a);
+			}
+		}
+
+		// called by the thread that swapped out a buffer, makes another
+		// buffer the insert buffer
+		void activate_next(InsertBuffer *full_buffer) {
+			while (true) {
+				const int n = num_buffers.load(std::memory_order_acquire);
+				for (int i = 0; i < n; ++i) {
+					auto *buf = insert_buffers[i].load(std::memory_order_relaxed);
+					if ((buf != full_buffer) && (buf->mu.try_lock())) {
+						activate(*buf);
+						buf->mu.unlock();
+						return;
+					}
 				}
-			
-				// check if this thread has a lock on the current buffer
-				// try to lock the current buffer
-				if (curr_buffer->mu.try_lock_shared()) {
-					// if successful, update the last buffer inserted into
-					last_insert_buffer[tnum] = curr_buffer;
-				} else {
-					// if not successful restart insert
-					goto start_insert;
+				// every buffer is being flushed
+				if (auto *buf = add_buffer()) {
+					activate(*buf);
+					return;
 				}
+				// the ring is at max_buffers, speed up the flush that frees
+				// the next one
+				if (!help())
+					_mm_pause();
 			}
-			if (curr_buffer->push_back(key, payload, &version)) {
+		}
 
-				if (last_insert_buffer[tnum]) {
-					last_insert_buffer[tnum]->mu.unlock_shared();
-					last_insert_buffer[tnum] = nullptr;
-				}
+		// report a flushed generation to the controller
+		void observe(const long capacity, const long fill_ns, const long flush_ns) {
+			if (!config.adaptive)
+				return;
 
-				if (insert_buffer.compare_exchange_strong(curr_buffer, nullptr, std::memory_order_relaxed)) {
-					// this thread has to insert everything 
-					//
-					// find next open insert buffer
-					while (true) {
-						for (auto &buf : insert_buffers) {
-							if ((&buf != curr_buffer) && (buf.mu.try_lock())) {
-								insert_buffer = &buf;
-								buf.mu.unlock();
-								goto loop_done;
-							}
-						}
-					}
+			typename BufferController::Observation obs {capacity, fill_ns, flush_ns,
+				stalls.exchange(0, std::memory_order_relaxed), 0, 0,
+				num_buffers.load(std::memory_order_relaxed)};
+			lookup_stats.for_each([&obs] (LookupStats &ls) {
+				obs.lookups += ls.lookups.exchange(0, std::memory_order_relaxed);
+				obs.scanned += ls.scanned.exchange(0, std::memory_order_relaxed);
+			});
+			if (controller.observe(obs) == BufferController::Decision::AddBuffer)
+				add_buffer();
+		}
 
-					loop_done:
-					insert_buffer.notify_all();
-					//wait for other threads to complete inserting
-					curr_buffer->mu.lock();
+		// Swap buf out as the insert buffer and flush it, returns false if
+		// another thread got to it first. Only buffers that filled up are
+		// reported to the controller.
+		bool rotate(InsertBuffer *buf, const bool full) {
+			if (!insert_buffer.compare_exchange_strong(buf, nullptr, std::memory_order_relaxed))
+				return false;
+			// this thread has to insert everything 
+			const long fill_ns = now_ns() - buf->activated_ns.load(std::memory_order_relaxed);
+			// locked before the next buffer is published, so a thread that
+			// sees an insert buffer again can wait for this flush on mu
+			buf->mu.lock();
+			//
+			// find next open insert buffer
+			activate_next(buf);
+			insert_buffer.notify_all();
+			//wait for other threads to complete inserting
+			buf->close();
 
-					for (const auto &p : curr_buffer->buf) {
-						BTree<K,Versioned<V>>::insert(p.first, p.second);
-					}
+			// blocks go into the tree in version order, the previous
+			// buffer may still be flushing
+			const long base = buf->min_version.load(std::memory_order_relaxed);
+			for (long a; (a = applied_version.load()) != base;) {
+				if (!help())
+					applied_version.wait(a);
+			}
 
-					curr_buffer->reset(version.load(std::memory_order_consume));
-					curr_buffer->mu.unlock();
+			const long flush_start = now_ns();
+			flush(*buf);
+			const long flush_ns = now_ns() - flush_start;
+			const long capacity = buf->capacity.load(std::memory_order_relaxed);
+			applied_version.store(buf->end_version());
+			applied_version.notify_all();
+			if (applied_version.load() >= buffered_from.load())
+				store_max(direct_key, buffered_key.load());
+			buf->drained();
 
-				} 
-				Versioned<V> vpayload (payload, version.fetch_add(1, std::memory_order_release));
-				// insert into buffer failed, directly insert instead
-				BTree<K,Versioned<V>>::insert(key, vpayload);
+			buf->mu.unlock();
+			if (full)
+				observe(capacity, fill_ns, flush_ns);
+			return true;
+		}
+
+		void write_direct(K key, V payload, bool tombstone) {
+			if (!(key < direct_key.load())) {
+				// buffered writes to the key may still be in flight
+				long from;
+				while ((from = buffered_from.load()) == std::numeric_limits<long>::max())
+					_mm_pause();
+				wait_applied(from);
 			}
-			// if the buffer has been swapped, unlock the last buffer that
-			// was inserted into
-			if (last_insert_buffer[tnum] && last_insert_buffer[tnum] != insert_buffer.load(std::memory_order_relaxed)) {
-				// unlock the last buffer that was inserted into
-				last_insert_buffer[tnum]->mu.unlock_shared();
-				last_insert_buffer[tnum] = nullptr;
+			if (tombstone)
+				Base::remove_if(key, [] (const V &) { return true; });
+			else
+				Base::insert(key, payload);
+		}
+
+		void write(K key, V payload, bool tombstone) {
+			if (key < buffered_key.load()) {
+				// not in the contended tail
+				write_direct(key, payload, tombstone);
+				return;
 			}
-			
+
+			start_insert:
+			InsertBuffer *curr_buffer;
+			// grab the next valid buffer		
+			while (!(curr_buffer = this->insert_buffer.load(std::memory_order_acquire))) {
+				if (config.adaptive)
+					stalls.fetch_add(1, std::memory_order_relaxed);
+				if (!help())
+					insert_buffer.wait(nullptr);
+			}
+
+			switch (curr_buffer->push_back(key, payload, tombstone, buffered_key)) {
+				case InsertBuffer::Push::Done:
+					return;
+				case InsertBuffer::Push::Moved:
+					write_direct(key, payload, tombstone);
+					return;
+				case InsertBuffer::Push::Full:
+					// full or already swapped out, whoever swaps it out
+					// inserts everything
+					rotate(curr_buffer, true);
+					// insert into buffer failed, retry on the next buffer so
+					// the entry gets a version from the next block
+					goto start_insert;
+			}
+		}
+
+		InsertBuffer *current_buffer() {
+			InsertBuffer *buf;
+			while (!(buf = insert_buffer.load(std::memory_order_acquire)))
+				insert_buffer.wait(nullptr);
+			return buf;
+		}
+
+		void flush_stale(std::stop_token stop) {
+			const auto period = std::chrono::nanoseconds(std::max(config.max_staleness_ns / 4, 1L));
+			std::unique_lock<std::mutex> lk(staleness_mu);
+			while (!staleness_cv.wait_for(lk, stop, period, [] { return false; })) {
+				if (stop.stop_requested())
+					break;
+				auto *buf = insert_buffer.load(std::memory_order_acquire);
+				// entries are at most as old as the buffer, checking every
+				// quarter of the bound keeps them below three quarters of it
+				if (buf && buf->size() &&
+						now_ns() - buf->activated_ns.load(std::memory_order_relaxed) >= config.max_staleness_ns / 2)
+					rotate(buf, false);
+			}
+		}
+
+	public:
+
+		RingBufferedBTree(const BufferConfig &config = BufferConfig()) :
+			insert_buffers(new std::atomic<InsertBuffer *>[config.checked().max_buffers]),
+			num_buffers(0), next_version(0), applied_version(0), applying(nullptr),
+			tail_key(std::numeric_limits<K>::lowest()),
+			direct_key(std::numeric_limits<K>::lowest()), buffered_key(std::numeric_limits<K>::lowest()),
+			buffered_from(0),
+			config(config.checked()), controller(this->config), stalls(0) {
+			activate(*add_buffer());
+			if (this->config.max_staleness_ns > 0)
+				staleness_flusher = std::jthread([this] (std::stop_token stop) { flush_stale(stop); });
+		}
+
+		~RingBufferedBTree() {
+			if (staleness_flusher.joinable()) {
+				staleness_flusher.request_stop();
+				staleness_flusher.join();
+			}
+			for (int i = 0; i < num_buffers.load(); ++i)
+				delete insert_buffers[i].load();
 		}
 		
-		bool lookup(const K key, V &result) {
-			long curr_version = version.load(std::memory_order_consume);
+		void insert(K key, V payload) {
+			write(key, payload, false);
+		}
 
+		// buffered like an insert, the flush removes the key from the tree
+		void remove(K key) {
+			write(key, V(), true);
+		}
+		
+		bool lookup(const K key, V &result) {
 			bool found = false;
 			Versioned<V> vres, r;
 			vres.version = -1;
 			r.version = -1;
 
-			auto *insert_buf = insert_buffer.load(std::memory_order_relaxed);
-			if (insert_buf && insert_buf->search(key, vres, curr_version))
-				found = true;
+			long scanned = 0;
 
-			for (auto &buf : insert_buffers) {
-				if (buf.search(key, r, curr_version)) {
+			// the insert buffer is one of the ring's buffers
+			const int n = num_buffers.load(std::memory_order_acquire);
+			for (int i = 0; i < n; ++i) {
+				auto *buf = insert_buffers[i].load(std::memory_order_relaxed);
+				if (buf->search(key, r, scanned)) {
 						vres.set(r);
 						found = true;
 				}
 			}
 
-			if (BTree<K,Versioned<V>>::lookup(key, r)) {
-				vres.set(r);
-				found = true;
+			if (config.adaptive) {
+				// only the owning thread writes its stats, no RMW needed
+				auto &ls = lookup_stats.local();
+				ls.lookups.store(ls.lookups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				ls.scanned.store(ls.scanned.load(std::memory_order_relaxed) + scanned, std::memory_order_relaxed);
 			}
-			if (found) {
+
+			// a buffered entry from a block that has been applied since may
+			// have been overwritten in the tree, by a direct write or by a
+			// later buffer that was drained before it was searched
+			if (found && vres.version >= applied_version.load()) {
+				if (vres.tombstone)
+					return false;
 				result = vres.val;
 				return true;
-			} else {
-				return false;
 			}
+			return Base::lookup(key, result);
 		}
 
-		void release_locks() {
-			int tnum = omp_get_thread_num();
+		// up to range entries with keys >= key in key order, including the
+		// ones still buffered
+		uint64_t scan(K key, int range, K *keys, V *output) {
+			MergedScan<K,Versioned<V>,V> merged;
+			const int n = num_buffers.load(std::memory_order_acquire);
+			for (int i = 0; i < n; ++i)
+				insert_buffers[i].load(std::memory_order_relaxed)->collect(key, merged);
+			// same as in lookup, applied entries are read from the tree
+			const long applied = applied_version.load();
+			merged.drop_if([applied] (const Versioned<V> &p) { return p.version < applied; });
+
+			return merged.run(key, range, [this] (K k, int r, K *ks, V *vs, bool inclusive) {
+				return Base::scan(k, r, ks, vs, inclusive);
+			}, keys, output);
+		}
 
-			if (last_insert_buffer[tnum]) {
-				// unlock the last buffer that was inserted into
-				last_insert_buffer[tnum]->mu.unlock_shared();
-				last_insert_buffer[tnum] = nullptr;
+		uint64_t scan(K key, int range, V *output) {
+			std::unique_ptr<K[]> keys(new K[std::max(range, 1)]);
+			return scan(key, range, keys.get(), output);
+		}
+
+		// Push every entry buffered before the call into the tree. Swaps out
+		// and flushes the insert buffer while buffers swapped out by other
+		// threads finish flushing.
+		void flush() {
+			InsertBuffer *buf = current_buffer();
+			if (buf->size())
+				rotate(buf, false);
+			// a buffer that lost the race above is locked by now
+			current_buffer();
+			const int n = num_buffers.load(std::memory_order_acquire);
+			for (int i = 0; i < n; ++i) {
+				auto *b = insert_buffers[i].load(std::memory_order_relaxed);
+				b->mu.lock();
+				b->mu.unlock();
 			}
 		}
+
+		// flush until nothing is buffered, for when inserts have stopped
+		void quiesce() {
+			do {
+				flush();
+			} while (current_buffer()->size());
+		}
 };
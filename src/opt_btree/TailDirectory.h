@@ -0,0 +1,84 @@
+#pragma once
+#include<atomic>
+#include<memory>
+#include<cstddef>
+#include<algorithm>
+#include<functional>
+#include<type_traits>
+#include<immintrin.h>
+
+// Open addressed, insert only directory from key prefix to the tail of an
+// append stream, for BufferedBTree and LockingBufferedBTree. A slot is
+// claimed with a CAS on its state and published once its tail exists.
+template<class K, class Tail>
+class TailDirectory {
+	struct Entry {
+		static constexpr int EMPTY = 0, CLAIMED = 1, READY = 2;
+		std::atomic<int> state;
+		K prefix;
+		Tail *tail;
+	};
+
+	// keys that agree above this bit share a tail
+	const int prefix_shift;
+	const int max_tails;
+	std::unique_ptr<Entry[]> entries;
+
+	public:
+		TailDirectory(const int prefix_shift, const int max_tails) :
+			prefix_shift(std::clamp<int>(prefix_shift, 0, sizeof(K) * 8 - 1)),
+			max_tails(std::max(max_tails, 1)), entries(new Entry[std::max(max_tails, 1)]) {
+			for (int i = 0; i < this->max_tails; ++i)
+				entries[i].state.store(Entry::EMPTY, std::memory_order_relaxed);
+		}
+
+		~TailDirectory() {
+			for (int i = 0; i < max_tails; ++i)
+				if (entries[i].state.load() == Entry::READY)
+					delete entries[i].tail;
+		}
+
+		// tail for the key's prefix, nullptr if there is none
+		Tail *find(const K key) {
+			return find(key, nullptr);
+		}
+
+		// tail for the key's prefix, make() sets one up if there is none,
+		// nullptr once the directory is full
+		template<class Make>
+		Tail *find(const K key, Make make) {
+			const K prefix = key >> prefix_shift;
+			const size_t h = std::hash<K>{}(prefix) * 0x9e3779b97f4a7c15ULL;
+			for (int i = 0; i < max_tails; ++i) {
+				auto &e = entries[(h + i) % max_tails];
+				int st = e.state.load(std::memory_order_acquire);
+				if (st == Entry::EMPTY) {
+					if constexpr (std::is_null_pointer_v<Make>)
+						return nullptr;
+					else if (e.state.compare_exchange_strong(st, Entry::CLAIMED)) {
+						e.prefix = prefix;
+						e.tail = make();
+						e.state.store(Entry::READY, std::memory_order_release);
+						return e.tail;
+					}
+				}
+				// another thread is setting the slot up
+				while (st == Entry::CLAIMED) {
+					_mm_pause();
+					st = e.state.load(std::memory_order_acquire);
+				}
+				if (e.prefix == prefix)
+					return e.tail;
+			}
+			// directory is full, the prefix goes to the tree
+			return nullptr;
+		}
+
+		// calls f on every tail set up so far
+		template<class F>
+		void for_each(F f) {
+			for (int i = 0; i < max_tails; ++i)
+				if (entries[i].state.load(std::memory_order_acquire) == Entry::READY)
+					f(*entries[i].tail);
+		}
+};
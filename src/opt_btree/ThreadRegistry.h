@@ -0,0 +1,122 @@
+#pragma once
+#include<atomic>
+#include<mutex>
+#include<vector>
+#include<array>
+#include<stdexcept>
+
+
+// Hands out small dense ids to whatever threads touch a tree, independent of
+// the threading runtime (OpenMP, std::thread, a custom pool, ...). Ids are
+// assigned on first use and recycled when the thread exits, so a long lived
+// pool keeps reusing the same low ids.
+class ThreadRegistry {
+	struct Handle {
+		int id;
+
+		Handle() : id(acquire()) {}
+		~Handle() {
+			release(id);
+		}
+	};
+
+	static inline std::mutex mu;
+	static inline std::vector<int> free_ids;
+	static inline std::atomic<int> next_id = 0;
+
+	static int acquire() {
+		{
+			std::lock_guard<std::mutex> lk(mu);
+			if (!free_ids.empty()) {
+				int id = free_ids.back();
+				free_ids.pop_back();
+				return id;
+			}
+		}
+		return next_id.fetch_add(1);
+	}
+
+	static void release(int id) {
+		std::lock_guard<std::mutex> lk(mu);
+		free_ids.push_back(id);
+	}
+
+	public:
+		// id of the calling thread
+		static int thread_id() {
+			static thread_local Handle handle;
+			return handle.id;
+		}
+		// one past the largest id ever handed out
+		static int id_bound() {
+			return next_id.load(std::memory_order_acquire);
+		}
+};
+
+
+// One T per registered thread. Storage is allocated in segments the first
+// time a thread with an id in that segment shows up, so there is no fixed
+// thread limit besides max_segments * segment_size.
+template<class T, int segment_size = 16>
+class PerThread {
+	public:
+		static constexpr int max_segments = 4096;
+
+	private:
+		// pad each slot to avoid false sharing between neighbouring threads
+		struct alignas(64) Slot {
+			T value {};
+		};
+		std::array<std::atomic<Slot *>, max_segments> segments;
+
+		Slot *segment(int seg) {
+			Slot *s = segments[seg].load(std::memory_order_acquire);
+			if (s)
+				return s;
+
+			Slot *fresh = new Slot[segment_size];
+			if (segments[seg].compare_exchange_strong(s, fresh, std::memory_order_acq_rel))
+				return fresh;
+			// another thread allocated the segment first
+			delete[] fresh;
+			return s;
+		}
+
+	public:
+		PerThread() {
+			for (auto &s : segments)
+				s.store(nullptr, std::memory_order_relaxed);
+		}
+
+		PerThread(const PerThread &) = delete;
+		PerThread &operator=(const PerThread &) = delete;
+
+		~PerThread() {
+			for (auto &s : segments)
+				delete[] s.load(std::memory_order_relaxed);
+		}
+
+		T &get(int id) {
+			if (id >= max_segments * segment_size)
+				throw std::runtime_error("PerThread : too many threads");
+			return segment(id / segment_size)[id % segment_size].value;
+		}
+
+		// slot of the calling thread
+		T &local() {
+			return get(ThreadRegistry::thread_id());
+		}
+
+		// visit every slot that has been allocated so far
+		template<class F>
+		void for_each(F f) {
+			const int bound = ThreadRegistry::id_bound();
+			for (int seg = 0; seg < max_segments && seg * segment_size < bound; ++seg) {
+				Slot *s = segments[seg].load(std::memory_order_acquire);
+				if (!s)
+					continue;
+				for (int i = 0; i < segment_size; ++i)
+					f(s[i].value);
+			}
+		}
+};
@@ -0,0 +1,51 @@
+#pragma once
+#include<atomic>
+#include<mutex>
+#include<vector>
+#include<utility>
+
+
+// Tombstones written to the tree as entries. One can be removed physically
+// once every write with a lower version is in the tree, before that an older
+// insert still on its way would bring the key back.
+template<class K>
+class TombstoneLog {
+	std::mutex mu;
+	std::vector<std::pair<K,long>> pending;
+	std::atomic<long> num_pending;
+
+	public:
+		TombstoneLog() : num_pending(0) {
+		}
+
+		void add(const K key, const long version) {
+			std::lock_guard<std::mutex> lk(mu);
+			pending.emplace_back(key, version);
+			num_pending.store(pending.size(), std::memory_order_relaxed);
+		}
+
+		bool empty() const {
+			return !num_pending.load(std::memory_order_relaxed);
+		}
+
+		// call remove(key, version) for every tombstone with a version below
+		// durable and forget it
+		template<class Remove>
+		void compact(const long durable, Remove &&remove) {
+			std::vector<std::pair<K,long>> ready;
+			{
+				std::lock_guard<std::mutex> lk(mu);
+				size_t n = 0;
+				for (const auto &t : pending) {
+					if (t.second < durable)
+						ready.push_back(t);
+					else
+						pending[n++] = t;
+				}
+				pending.resize(n);
+				num_pending.store(n, std::memory_order_relaxed);
+			}
+			for (const auto &t : ready)
+				remove(t.first, t.second);
+		}
+};
@@ -1,20 +1,29 @@
 #pragma once
+#include<type_traits>
 
 template<class T>
 struct Versioned {
 	T val;
-	long version;
+	// the tombstone takes the version's top bit, versions never get near
+	// it, so that a Versioned<long> stays two words
+	long version : 63;
+	// a delete, ordered against inserts like any other write
+	bool tombstone : 1 = false;
 
 	Versioned() = default;
-	Versioned(const T v, const long ver) : val(v), version(ver) {}
+	Versioned(const T v, const long ver, const bool tombstone = false) :
+		val(v), version(ver), tombstone(tombstone) {}
 	Versioned(const Versioned<T> &other) = default;
 	Versioned(Versioned<T> &&other) = default;
 	Versioned<T> &operator=(const Versioned<T> &other) = default;
 
+	// last writer wins, writes that share a version (direct tree inserts)
+	// are applied in the order they reach the leaf
 	void set(const Versioned<T> &other) {
-		if (other.version > this->version) {
+		if (other.version >= this->version) {
 			val = other.val;
 			version = other.version;
+			tombstone = other.tombstone;
 		} 	
 	}
 
@@ -22,3 +31,11 @@ struct Versioned {
 			
 
 };
+
+static_assert(sizeof(Versioned<long>) == 16);
+
+template<class T>
+struct is_versioned : std::false_type {};
+
+template<class T>
+struct is_versioned<Versioned<T>> : std::true_type {};
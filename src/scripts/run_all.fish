@@ -4,18 +4,16 @@ set -l num_reps 5
 
 for f in (ls ./workload)
 	echo "running $f"
+	# one thread count per run, a hang or crash only costs that one
 	for i in (seq 32)
 		echo -n "num threads $i"
-		set -x OMP_NUM_THREADS $i
-
-		for j in (seq $num_reps)
-			echo -n "."
-			timeout 5m ./vanilla ./workload/$f 1>> res.json
-			if test $status != 0
-				echo 'TIMED OUT'
-			end
+		# shared keeps the insert order, tail workloads insert at one tail
+		timeout (math 5 \* $num_reps)m ./vanilla --threads=$i --reps=$num_reps --pin=smt-last --dispatch=shared ./workload/$f 1>> res.json
+		if test $status != 0
+			echo ' FAILED'
+		else
+			echo ' done'
 		end
-		echo "done"
 	end
 end
 
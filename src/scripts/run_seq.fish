@@ -4,17 +4,13 @@ set -l num_reps 5
 
 set -l f 'seq_insert.txt'
 echo "running $f"
+# one thread count per run, a hang or crash only costs that one
 for i in (seq 18 32)
 	echo -n "num threads $i"
-	set -x OMP_NUM_THREADS $i
-
-	for j in (seq $num_reps)
-		echo -n "."
-		timeout 5m ./vanilla ./workload/$f 1>> res.json
-		if test $status != 0
-			echo 'TIMED OUT'
-		end
-
+	timeout (math 5 \* $num_reps)m ./vanilla --threads=$i --reps=$num_reps --pin=smt-last --dispatch=shared ./workload/$f 1>> res.json
+	if test $status != 0
+		echo ' FAILED'
+	else
+		echo ' done'
 	end
-	echo "done"
 end
@@ -0,0 +1,76 @@
+#include <map>
+#include <thread>
+#include <vector>
+#include "../opt_btree/BufferBTree.h"
+#include "../opt_btree/LockingBufferBTree.h"
+#include "check.h"
+
+// BufferedBTree and LockingBufferedBTree with one append stream per key
+// prefix, threads inserting increasing keys under their own prefix at
+// once. Checks that each stream fills a tail of its own, that the full
+// tail leaves are handed to the tree, and that lookups and scans find
+// every key on either side of the handoff.
+
+static const int SHIFT = 40;
+
+// whether k is in the tree itself, not only in a tail leaf
+template<class Tree>
+static bool in_tree(Tree &tree, long k) {
+	long v;
+	return tree.root.load() && tree.BTree<long, long>::lookup(k, v);
+}
+
+static long key_of(int stream, long i) {
+	return (long)(stream + 1) << SHIFT | i;
+}
+
+template<class Tree>
+static void prefix_streams() {
+	Tree tree(.75, SHIFT);
+	const int threads = 4;
+	const long leaf = tree.max_inserts + 1;
+	// three handoffs per stream, and half a leaf left in the tail
+	const long n = leaf * 3 + leaf / 2;
+	std::vector<std::thread> ts;
+	for (int t = 0; t < threads; ++t) {
+		ts.emplace_back([&tree, n, t] {
+			for (long i = 0; i < n; ++i)
+				tree.insert(key_of(t, i), i);
+		});
+	}
+	for (auto &t : ts)
+		t.join();
+
+	std::map<long, long> ref;
+	for (int t = 0; t < threads; ++t) {
+		for (long i = 0; i < n; ++i) {
+			const long k = key_of(t, i);
+			ref[k] = i;
+			long v = -1;
+			CHECK(tree.lookup(k, v) && v == i);
+			// only the stream's own keys fill its tail, so it is handed
+			// off every leaf keys
+			CHECK(in_tree(tree, k) == (i < n / leaf * leaf));
+		}
+	}
+
+	std::vector<long> keys(ref.size() + 1), vals(ref.size() + 1);
+	const uint64_t got = tree.scan(0, keys.size(), keys.data(), vals.data());
+	CHECK(got == ref.size());
+	auto it = ref.begin();
+	for (uint64_t i = 0; i < got && it != ref.end(); ++i, ++it)
+		CHECK(keys[i] == it->first && vals[i] == it->second);
+	// scans across the last handoff of each stream
+	for (int t = 0; t < threads; ++t) {
+		const long from = n / leaf * leaf - 5;
+		CHECK(tree.scan(key_of(t, from), 10, keys.data(), vals.data()) == 10);
+		for (long i = 0; i < 10; ++i)
+			CHECK(keys[i] == key_of(t, from + i) && vals[i] == from + i);
+	}
+}
+
+int main() {
+	prefix_streams<BufferedBTree<long, long>>();
+	prefix_streams<LockingBufferedBTree<long, long>>();
+	return failed();
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <iostream>
+
+// The tests are built with the benchmark's flags, -DNDEBUG among them, so
+// they check with CHECK instead of assert. A failed check is reported and
+// counted, main returns failed() as the exit code.
+inline long &failures() {
+	static long n = 0;
+	return n;
+}
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		std::cerr << __FILE__ << ':' << __LINE__ << " failed: " #cond "\n"; \
+		failures()++; \
+	} \
+} while (0)
+
+inline int failed() {
+	if (failures())
+		std::cerr << failures() << " checks failed\n";
+	return failures() ? 1 : 0;
+}
@@ -0,0 +1,215 @@
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "../opt_btree/CompressedLeaf.h"
+#include "check.h"
+
+// CompressedLeaf on its own and as the leaf of a BTree, checked against a
+// std::map: every encoding, the switches between them, splits and erases.
+
+using namespace btreeolc;
+using Leaf = CompressedLeaf<long, long>;
+using Mode = Leaf::Mode;
+
+// keys this far apart fill a leaf in the encoding
+static const std::pair<Mode, long> STRIDES[] = {
+	{Mode::Dense, 1}, {Mode::Delta16, 2}, {Mode::Delta32, 1 << 10}, {Mode::Wide, 1L << 33}};
+
+// the leaf holds exactly what m does, and finds it
+static void check_leaf(Leaf &leaf, const std::map<long, long> &m) {
+	CHECK(leaf.count == m.size());
+	unsigned i = 0;
+	for (const auto &[k, v] : m) {
+		if (i >= leaf.count)
+			break;
+		CHECK(leaf.keyAt(i) == k);
+		CHECK(leaf.payloadAt(i) == v);
+		CHECK(leaf.lowerBound(k) == i);
+		if (!m.count(k + 1))
+			CHECK(leaf.lowerBound(k + 1) == i + 1);
+		i++;
+	}
+	if (!m.empty()) {
+		CHECK(leaf.lowerBound(m.begin()->first - 1) == 0);
+		CHECK(leaf.lowerBound(m.rbegin()->first + 1) == leaf.count);
+	}
+}
+
+// A leaf filled in each encoding until it is full, then split. Both
+// halves keep the encoding.
+static void fill_and_split(std::mt19937_64 &rng) {
+	for (const auto &[mode, stride] : STRIDES) {
+		const unsigned cap = Leaf::capacity(mode);
+		std::vector<long> keys(cap);
+		for (unsigned i = 0; i < cap; ++i)
+			keys[i] = -7 + stride * i;
+		// a dense run only grows at its end
+		if (mode != Mode::Dense)
+			std::shuffle(keys.begin(), keys.end(), rng);
+		Leaf leaf;
+		std::map<long, long> m;
+		for (long k : keys) {
+			CHECK(leaf.canInsert(k));
+			leaf.insert(k, ~k);
+			m[k] = ~k;
+		}
+		CHECK(leaf.layout.mode == mode);
+		CHECK(!leaf.canInsert(-7 + stride * cap));
+		// updates of present keys always fit
+		CHECK(leaf.canInsert(keys[0]));
+		leaf.insert(keys[0], 1);
+		m[keys[0]] = 1;
+		check_leaf(leaf, m);
+
+		long sep;
+		Leaf *right = leaf.split(sep);
+		std::map<long, long> lm(m.begin(), m.upper_bound(sep));
+		std::map<long, long> rm(m.upper_bound(sep), m.end());
+		CHECK(leaf.layout.mode == mode);
+		CHECK(right->layout.mode == mode);
+		CHECK(sep == lm.rbegin()->first);
+		check_leaf(leaf, lm);
+		check_leaf(*right, rm);
+		delete right;
+	}
+}
+
+// Inserts that leave the encoding's range widen the leaf, one step at a
+// time, keys below the base rebase it, erases keep it consistent.
+static void switch_encodings() {
+	Leaf leaf;
+	std::map<long, long> m;
+	auto insert = [&] (long k) {
+		CHECK(leaf.canInsert(k));
+		leaf.insert(k, k * 3);
+		m[k] = k * 3;
+		check_leaf(leaf, m);
+	};
+	auto erase = [&] (long k) {
+		leaf.erase(leaf.lowerBound(k));
+		m.erase(k);
+		check_leaf(leaf, m);
+	};
+	for (long k = 100; k < 110; ++k)
+		insert(k);
+	CHECK(leaf.layout.mode == Mode::Dense);
+	erase(100);
+	erase(109);
+	CHECK(leaf.layout.mode == Mode::Dense);
+	// a hole ends the run
+	erase(105);
+	CHECK(leaf.layout.mode == Mode::Delta16);
+	insert(60);
+	CHECK(leaf.layout.mode == Mode::Delta16);
+	insert(1 << 20);
+	CHECK(leaf.layout.mode == Mode::Delta32);
+	insert(-5);
+	CHECK(leaf.layout.mode == Mode::Delta32);
+	insert(1L << 40);
+	CHECK(leaf.layout.mode == Mode::Wide);
+	insert(-(1L << 40));
+	erase(60);
+	erase(1L << 40);
+	CHECK(leaf.layout.mode == Mode::Wide);
+}
+
+static void walk_leaves(NodeBase *node, std::vector<Leaf *> &leaves) {
+	if (node->type == PageType::BTreeLeaf) {
+		leaves.push_back(static_cast<Leaf *>(node));
+		return;
+	}
+	auto inner = static_cast<BTreeInner<long> *>(node);
+	for (unsigned i = 0; i <= inner->count; ++i)
+		walk_leaves(inner->children[i], leaves);
+}
+
+static void check_tree(BTree<long, long, Leaf> &tree, const std::map<long, long> &m, std::mt19937_64 &rng) {
+	for (const auto &[k, v] : m) {
+		long r = 0;
+		CHECK(tree.lookup(k, r) && r == v);
+		if (!m.count(k + 1))
+			CHECK(!tree.lookup(k + 1, r));
+	}
+	long keys[100], vals[100];
+	for (int i = 0; i < 1000; ++i) {
+		const long lo = m.begin()->first, hi = m.rbegin()->first;
+		const long start = lo + (long)(rng() % (uint64_t)(hi - lo + 1));
+		const uint64_t n = tree.scan(start, 100, keys, vals);
+		auto it = m.lower_bound(start);
+		uint64_t j = 0;
+		for (; j < 100 && it != m.end(); ++j, ++it)
+			CHECK(j < n && keys[j] == it->first && vals[j] == it->second);
+		CHECK(n == j);
+	}
+}
+
+// A tree of keys stride apart, its leaves split in the encoding they fill
+// in, then every 7th key removed.
+static void tree_per_encoding(std::mt19937_64 &rng) {
+	for (const auto &[mode, stride] : STRIDES) {
+		const long n = 100000;
+		std::vector<long> keys(n);
+		for (long i = 0; i < n; ++i)
+			keys[i] = stride * i;
+		if (mode != Mode::Dense)
+			std::shuffle(keys.begin(), keys.end(), rng);
+		BTree<long, long, Leaf> tree;
+		std::map<long, long> m;
+		for (long k : keys) {
+			tree.insert(k, k + 1);
+			m[k] = k + 1;
+		}
+		std::vector<Leaf *> leaves;
+		walk_leaves(tree.root, leaves);
+		CHECK(leaves.size() > 1);
+		long in_mode = 0;
+		for (Leaf *leaf : leaves)
+			in_mode += leaf->layout.mode == mode;
+		CHECK(in_mode * 2 > (long)leaves.size());
+		check_tree(tree, m, rng);
+
+		for (long i = 0; i < n; i += 7) {
+			CHECK(tree.remove_if(stride * i, [] (const long &) { return true; }));
+			m.erase(stride * i);
+		}
+		check_tree(tree, m, rng);
+	}
+}
+
+// threads inserting keys of every stride into one tree at once
+static void concurrent_inserts(std::mt19937_64 &rng) {
+	BTree<long, long, Leaf> tree;
+	const int threads = 4;
+	const long n = 50000;
+	std::vector<std::thread> ts;
+	for (int t = 0; t < threads; ++t) {
+		ts.emplace_back([&tree, t] {
+			const long stride = STRIDES[t].second;
+			for (long i = 0; i < n; ++i) {
+				const long k = stride * (i * threads + t);
+				tree.insert(k, k);
+			}
+		});
+	}
+	for (auto &t : ts)
+		t.join();
+	std::map<long, long> m;
+	for (int t = 0; t < threads; ++t) {
+		for (long i = 0; i < n; ++i) {
+			const long k = STRIDES[t].second * (i * threads + t);
+			m[k] = k;
+		}
+	}
+	check_tree(tree, m, rng);
+}
+
+int main() {
+	std::mt19937_64 rng(42);
+	fill_and_split(rng);
+	switch_encodings();
+	tree_per_encoding(rng);
+	concurrent_inserts(rng);
+	return failed();
+}
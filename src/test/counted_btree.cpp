@@ -0,0 +1,118 @@
+#include <random>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include "../opt_btree/CountedBTree.h"
+#include "check.h"
+
+// CountedBTree's rank, select, count_range and size checked against a
+// sorted vector of its keys, after inserts, removes and concurrent writes.
+
+using namespace btreeolc;
+using Tree = CountedBTree<long, long>;
+
+// every inner count is the number of entries below its child
+static uint64_t check_counts(NodeBase *node) {
+	if (node->type == PageType::BTreeLeaf)
+		return node->count;
+	auto inner = static_cast<Tree::Inner *>(node);
+	uint64_t total = 0;
+	for (unsigned i = 0; i <= inner->count; ++i) {
+		const uint64_t n = check_counts(inner->children[i]);
+		CHECK(inner->counts[i] == n);
+		total += n;
+	}
+	return total;
+}
+
+// tree holds the keys of ref, sorted, each with its key as the value
+static void check_tree(Tree &tree, const std::vector<long> &ref, std::mt19937_64 &rng) {
+	CHECK(tree.size() == ref.size());
+	CHECK(check_counts(tree.root) == ref.size());
+	const long hi = ref.empty() ? 1 : ref.back() + 2;
+	for (int i = 0; i < 20000; ++i) {
+		const long k = (long)(rng() % hi) - 1;
+		const uint64_t below = std::lower_bound(ref.begin(), ref.end(), k) - ref.begin();
+		const uint64_t upto = std::upper_bound(ref.begin(), ref.end(), k) - ref.begin();
+		CHECK(tree.rank(k) == below);
+		CHECK(tree.rank(k, true) == upto);
+		const long k2 = k + (long)(rng() % 1000);
+		const uint64_t in = std::upper_bound(ref.begin(), ref.end(), k2) - ref.begin() - below;
+		CHECK(tree.count_range(k, k2) == in);
+		CHECK(tree.count_range(k2, k) == (k == k2 ? in : 0));
+	}
+	for (uint64_t i = 0; i < ref.size(); i += 1 + rng() % 7) {
+		long k = -1, v = -1;
+		CHECK(tree.select(i, k, v) && k == ref[i] && v == ref[i]);
+	}
+	long k, v;
+	CHECK(!tree.select(ref.size(), k, v));
+}
+
+int main() {
+	std::mt19937_64 rng(42);
+	Tree tree;
+	std::vector<long> ref;
+	check_tree(tree, ref, rng);
+
+	// single threaded, with upserts of present keys
+	for (int i = 0; i < 200000; ++i) {
+		const long k = (long)(rng() % 1000000);
+		tree.insert(k, k);
+		ref.push_back(k);
+	}
+	std::sort(ref.begin(), ref.end());
+	ref.erase(std::unique(ref.begin(), ref.end()), ref.end());
+	check_tree(tree, ref, rng);
+
+	// removes, some of absent keys
+	std::vector<long> removed;
+	for (long k = 0; k < 1000000; k += 1 + rng() % 4) {
+		const bool present = std::binary_search(ref.begin(), ref.end(), k);
+		CHECK(tree.remove_if(k, [] (const long &) { return true; }) == present);
+		if (present)
+			removed.push_back(k);
+	}
+	std::vector<long> left;
+	std::set_difference(ref.begin(), ref.end(), removed.begin(), removed.end(), std::back_inserter(left));
+	ref = left;
+	check_tree(tree, ref, rng);
+
+	// threads removing and inserting keys of their own residue at once,
+	// new keys and present ones
+	const int threads = 4;
+	std::vector<std::thread> ts;
+	for (int t = 0; t < threads; ++t) {
+		ts.emplace_back([&tree, t] {
+			std::mt19937_64 rng(t);
+			for (int i = 0; i < 100000; ++i) {
+				const long k = (long)(rng() % 2000000) / threads * threads + t;
+				if (i % 3)
+					tree.insert(k, k);
+				else
+					tree.remove_if(k, [] (const long &) { return true; });
+			}
+		});
+	}
+	for (auto &t : ts)
+		t.join();
+	// replay each thread's ops on the reference, threads touch disjoint keys
+	std::vector<char> present(2000000);
+	for (long k : ref)
+		present[k] = 1;
+	for (int t = 0; t < threads; ++t) {
+		std::mt19937_64 rng(t);
+		for (int i = 0; i < 100000; ++i) {
+			const long k = (long)(rng() % 2000000) / threads * threads + t;
+			present[k] = i % 3 != 0;
+		}
+	}
+	ref.clear();
+	for (long k = 0; k < (long)present.size(); ++k) {
+		if (present[k])
+			ref.push_back(k);
+	}
+	check_tree(tree, ref, rng);
+	return failed();
+}
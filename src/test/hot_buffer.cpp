@@ -0,0 +1,239 @@
+#include <map>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "../opt_btree/HotBufferBTree.h"
+#include "check.h"
+
+// HotBufferedBTree with contention forced on an interior leaf: the leaf is
+// held write locked while another thread inserts into it. Checks that the
+// leaf's range gets a delta, that lookups and scans merge it, that a full
+// delta is folded into the tree, that a partly filled one is folded and
+// detached once it runs cool, and that flush() and quiesce() fold on demand.
+
+using Tree = HotBufferedBTree<long, long>;
+using Base = BTree<long, Versioned<long>>;
+using Leaf = BTreeLeaf<long, Versioned<long>>;
+
+static Leaf *leaf_of(Tree &tree, long k) {
+	NodeBase *node = tree.root;
+	while (node->type == PageType::BTreeInner) {
+		auto inner = static_cast<BTreeInner<long> *>(node);
+		node = inner->children[inner->lowerBound(k)];
+	}
+	return static_cast<Leaf *>(node);
+}
+
+// whether k is in the tree itself, not only in a delta, and with what
+static bool in_tree(Tree &tree, long k, long &v) {
+	Versioned<long> r;
+	if (!tree.Base::lookup(k, r) || r.tombstone)
+		return false;
+	v = r.val;
+	return true;
+}
+
+// Inserts k while its leaf is write locked, true if the insert got
+// through, which it only can through a delta.
+static bool insert_contended(Tree &tree, long k, long v) {
+	Leaf *leaf = leaf_of(tree, k);
+	bool needRestart = false;
+	leaf->writeLockOrRestart(needRestart);
+	CHECK(!needRestart);
+	std::atomic<bool> done {false};
+	std::thread writer([&] {
+		tree.insert(k, v);
+		done = true;
+	});
+	const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!done && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	const bool got_through = done;
+	leaf->writeUnlock();
+	writer.join();
+	return got_through;
+}
+
+// the tree, deltas merged, holds exactly ref
+static void check_all(Tree &tree, const std::map<long, long> &ref) {
+	for (const auto &[k, v] : ref) {
+		long r = -1;
+		CHECK(tree.lookup(k, r) && r == v);
+	}
+	std::vector<long> keys(ref.size() + 1), vals(ref.size() + 1);
+	const uint64_t n = tree.scan(-1, keys.size(), keys.data(), vals.data());
+	CHECK(n == ref.size());
+	auto it = ref.begin();
+	for (uint64_t i = 0; i < n && it != ref.end(); ++i, ++it)
+		CHECK(keys[i] == it->first && vals[i] == it->second);
+}
+
+// a tree with every tenth key below 100000, deltas of 64 entries
+static HotBufferConfig config_of(long cool_fill_ns) {
+	HotBufferConfig config;
+	config.delta_capacity = 64;
+	// every restart counts, however slowly the writer gets to run
+	config.window_ns = 10'000'000'000L;
+	config.cool_fill_ns = cool_fill_ns;
+	return config;
+}
+
+static void fill(Tree &tree, std::map<long, long> &ref) {
+	for (long k = 0; k < 100000; k += 10) {
+		tree.insert(k, k);
+		ref[k] = k;
+	}
+	CHECK(tree.hot_ranges() == 0);
+}
+
+static void attach_merge_fold() {
+	const HotBufferConfig config = config_of(60'000'000'000L);
+	Tree tree(config);
+	std::map<long, long> ref;
+	fill(tree, ref);
+
+	// an interior leaf, the range between its first and last key is its own
+	const long hot = 50001;
+	Leaf *leaf = leaf_of(tree, hot);
+	CHECK(leaf != leaf_of(tree, 0) && leaf != leaf_of(tree, 99990));
+	const long first = leaf->keys[0];
+	CHECK(insert_contended(tree, hot, 1));
+	ref[hot] = 1;
+	CHECK(tree.hot_ranges() == 1);
+
+	// writes to the range go to the delta, lookups and scans see them
+	long v;
+	CHECK(!in_tree(tree, hot, v));
+	tree.insert(first, 7);
+	ref[first] = 7;
+	CHECK(in_tree(tree, first, v) && v == first);
+	tree.remove(first + 10);
+	ref.erase(first + 10);
+	CHECK(in_tree(tree, first + 10, v));
+	// other leaves take writes directly
+	tree.insert(15, 15);
+	ref[15] = 15;
+	CHECK(in_tree(tree, 15, v));
+	check_all(tree, ref);
+
+	// filling the delta folds it into the tree
+	long appended = 3;
+	for (long k = first + 1; appended < config.delta_capacity; ++k) {
+		if (k % 10 && k != hot) {
+			tree.insert(k, -k);
+			ref[k] = -k;
+			appended++;
+		}
+	}
+	CHECK(in_tree(tree, hot, v) && v == 1);
+	CHECK(in_tree(tree, first, v) && v == 7);
+	CHECK(!in_tree(tree, first + 10, v));
+	CHECK(tree.hot_ranges() == 1);
+	check_all(tree, ref);
+}
+
+// a delta left partly filled is folded and detached in the background
+static void cool_down() {
+	Tree tree(config_of(20'000'000));
+	std::map<long, long> ref;
+	fill(tree, ref);
+	const long hot = 50001;
+	const long first = leaf_of(tree, hot)->keys[0];
+	CHECK(insert_contended(tree, hot, 1));
+	ref[hot] = 1;
+	tree.insert(first + 1, 2);
+	ref[first + 1] = 2;
+	tree.remove(first + 10);
+	ref.erase(first + 10);
+
+	const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (tree.hot_ranges() && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(tree.hot_ranges() == 0);
+	long v;
+	CHECK(in_tree(tree, hot, v) && v == 1);
+	CHECK(in_tree(tree, first + 1, v) && v == 2);
+	// nothing is buffered anymore, the tombstone was removed for good
+	Versioned<long> r;
+	CHECK(!tree.Base::lookup(first + 10, r));
+	check_all(tree, ref);
+}
+
+// flush() folds and keeps the delta, quiesce() folds and detaches it
+static void flush_quiesce() {
+	Tree tree(config_of(0));
+	std::map<long, long> ref;
+	fill(tree, ref);
+	const long hot = 50001;
+	const long first = leaf_of(tree, hot)->keys[0];
+	CHECK(insert_contended(tree, hot, 1));
+	ref[hot] = 1;
+	long v;
+	CHECK(!in_tree(tree, hot, v));
+
+	tree.flush();
+	CHECK(in_tree(tree, hot, v) && v == 1);
+	CHECK(tree.hot_ranges() == 1);
+	// the reopened delta takes the range's writes again
+	tree.insert(first + 1, 2);
+	ref[first + 1] = 2;
+	tree.remove(first + 10);
+	ref.erase(first + 10);
+	CHECK(!in_tree(tree, first + 1, v));
+	CHECK(in_tree(tree, first + 10, v));
+	check_all(tree, ref);
+
+	tree.quiesce();
+	CHECK(tree.hot_ranges() == 0);
+	CHECK(in_tree(tree, first + 1, v) && v == 2);
+	Versioned<long> r;
+	CHECK(!tree.Base::lookup(first + 10, r));
+	// the range takes plain tree inserts again
+	tree.insert(first + 2, 3);
+	ref[first + 2] = 3;
+	CHECK(in_tree(tree, first + 2, v) && v == 3);
+	check_all(tree, ref);
+}
+
+// threads writing into a hot range at once
+static void concurrent_writes() {
+	Tree tree(config_of(60'000'000'000L));
+	std::map<long, long> ref;
+	fill(tree, ref);
+	CHECK(insert_contended(tree, 50001, 1));
+	ref[50001] = 1;
+	const long first = leaf_of(tree, 50001)->keys[0];
+	const int threads = 4;
+	std::vector<std::thread> ts;
+	for (int t = 0; t < threads; ++t) {
+		ts.emplace_back([&tree, first, t] {
+			for (long i = 0; i < 2000; ++i) {
+				const long k = i % 2 ? (first + 1) / threads * threads + threads * (1 + i / 2 % 20) + t : 200000 + i * threads + t;
+				tree.insert(k, k + i);
+			}
+		});
+	}
+	for (auto &t : ts)
+		t.join();
+	// the last write of each key wins, thread t writes the keys = t mod threads
+	for (int t = 0; t < threads; ++t) {
+		for (long i = 0; i < 2000; ++i) {
+			const long k = i % 2 ? (first + 1) / threads * threads + threads * (1 + i / 2 % 20) + t : 200000 + i * threads + t;
+			ref[k] = k + i;
+		}
+	}
+	check_all(tree, ref);
+	// everything left in the delta goes to the tree
+	tree.quiesce();
+	CHECK(tree.hot_ranges() == 0);
+	check_all(tree, ref);
+}
+
+int main() {
+	attach_merge_fold();
+	cool_down();
+	flush_quiesce();
+	concurrent_writes();
+	return failed();
+}